@@ -0,0 +1,522 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "threadpool.h"
+#include "mime.h"
+#include "response.h"
+
+/**
+ * bench.c
+ *
+ * Microbenchmarks for the thread pool and the request hot path.
+ * Each benchmark is run with more and more iterations until it takes
+ * at least MIN_TIME_NS, like Google Benchmark, and the output
+ * (--json) uses Google Benchmark's JSON format so existing tools can
+ * compare runs across commits. Fixtures are built from FIXTURE_SEED,
+ * so every run measures the same tree.
+ */
+
+#define MIN_TIME_NS 500000000ULL
+#define MAX_ITERATIONS 100000000L
+#define FIXTURE_SEED 42
+#define MAX_BENCHMARKS 64
+
+// server.c, linked with -DSERVER_NO_MAIN
+response_t* request_handler(const char* request);
+response_t* handle_error_response(int error_type, const char* path, const char* mime_type);
+char* generate_directory_listing(const char* path, const char* query);
+extern threadpool* listing_pool;
+
+typedef struct bench_state_st {
+    long iterations;        //how many times the benchmark must do its work
+    long items;             //items processed, for items_per_second
+    int arg0;
+    int arg1;
+    unsigned long long real_start, cpu_start;
+    unsigned long long real_ns, cpu_ns;
+} bench_state;
+
+typedef void (*bench_fn)(bench_state*);
+
+typedef struct benchmark_st {
+    char name[128];
+    bench_fn fn;
+    int arg0;
+    int arg1;
+} benchmark;
+
+static benchmark benchmarks[MAX_BENCHMARKS];
+static int benchmark_count = 0;
+static char fixture_root[64];    // mkdtemp under /tmp
+
+static unsigned long long clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Benchmarks call these around the measured part, setup and teardown stay outside
+static void start_timing(bench_state* st) {
+    st->real_start = clock_ns(CLOCK_MONOTONIC);
+    st->cpu_start = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+static void stop_timing(bench_state* st) {
+    st->real_ns = clock_ns(CLOCK_MONOTONIC) - st->real_start;
+    st->cpu_ns = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - st->cpu_start;
+}
+
+static void register_benchmark(bench_fn fn, int arg0, int arg1, const char* fmt, ...) {
+    if (benchmark_count == MAX_BENCHMARKS) {
+        printf("too many benchmarks\n");
+        exit(1);
+    }
+    benchmark* b = &benchmarks[benchmark_count++];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(b->name, sizeof(b->name), fmt, ap);
+    va_end(ap);
+    b->fn = fn;
+    b->arg0 = arg0;
+    b->arg1 = arg1;
+}
+
+/* ---- thread pool ---- */
+
+// Counts finished tasks and wakes the producer when the last one is done.
+// done and target are only accessed atomically, the lock just pairs with cond
+typedef struct latch_st {
+    long done;
+    long target;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} latch;
+
+static void init_latch(latch* l, long target) {
+    l->done = 0;
+    l->target = target;
+    pthread_mutex_init(&l->lock, NULL);
+    pthread_cond_init(&l->cond, NULL);
+}
+
+static void set_latch_target(latch* l, long target) {
+    __atomic_store_n(&l->target, target, __ATOMIC_RELEASE);
+}
+
+static void wait_latch(latch* l) {
+    pthread_mutex_lock(&l->lock);
+    while (__atomic_load_n(&l->done, __ATOMIC_ACQUIRE) < __atomic_load_n(&l->target, __ATOMIC_ACQUIRE)) {
+        pthread_cond_wait(&l->cond, &l->lock);
+    }
+    pthread_mutex_unlock(&l->lock);
+}
+
+static void destroy_latch(latch* l) {
+    pthread_mutex_destroy(&l->lock);
+    pthread_cond_destroy(&l->cond);
+}
+
+static int count_down(void* arg) {
+    latch* l = (latch*)arg;
+    if (__atomic_add_fetch(&l->done, 1, __ATOMIC_ACQ_REL) == __atomic_load_n(&l->target, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&l->lock);
+        pthread_cond_signal(&l->cond);
+        pthread_mutex_unlock(&l->lock);
+    }
+    return 0;
+}
+
+// One task at a time: dispatch, then wait until a worker has run it
+static void bm_dispatch_roundtrip(bench_state* st) {
+    threadpool* tp = create_threadpool(st->arg0, MAXW_IN_QUEUE);
+    latch l;
+    init_latch(&l, 0);
+
+    start_timing(st);
+    for (long i = 0; i < st->iterations; i++) {
+        set_latch_target(&l, i + 1);
+        dispatch(tp, count_down, &l);
+        wait_latch(&l);
+    }
+    stop_timing(st);
+
+    st->items = st->iterations;
+    destroy_threadpool(tp);
+    destroy_latch(&l);
+}
+
+// 1 producer, arg0 consumers, queue of arg1: how fast can the queue be drained
+static void bm_dispatch_throughput(bench_state* st) {
+    threadpool* tp = create_threadpool(st->arg0, st->arg1);
+    latch l;
+    init_latch(&l, st->iterations);
+
+    start_timing(st);
+    for (long i = 0; i < st->iterations; i++) {
+        dispatch(tp, count_down, &l);
+    }
+    wait_latch(&l);
+    stop_timing(st);
+
+    st->items = st->iterations;
+    destroy_threadpool(tp);
+    destroy_latch(&l);
+}
+
+// Same as above with dispatch_batch, arg1 jobs per call (queue of MAXW_IN_QUEUE)
+static void bm_dispatch_batch_throughput(bench_state* st) {
+    threadpool* tp = create_threadpool(st->arg0, MAXW_IN_QUEUE);
+    int batch = st->arg1;
+    long batches = (st->iterations + batch - 1) / batch;
+    void** args = (void**)malloc(batch * sizeof(void*));
+    latch l;
+    init_latch(&l, batches * batch);
+    for (int i = 0; i < batch; i++) {
+        args[i] = &l;
+    }
+
+    start_timing(st);
+    for (long i = 0; i < batches; i++) {
+        dispatch_batch(tp, count_down, args, batch);
+    }
+    wait_latch(&l);
+    stop_timing(st);
+
+    st->items = batches * batch;
+    destroy_threadpool(tp);
+    destroy_latch(&l);
+    free(args);
+}
+
+typedef struct producer_st {
+    threadpool* tp;
+    latch* l;
+    long count;
+} producer;
+
+static void* produce(void* p) {
+    producer* pr = (producer*)p;
+    for (long i = 0; i < pr->count; i++) {
+        dispatch(pr->tp, count_down, pr->l);
+    }
+    return NULL;
+}
+
+// arg0 producers and arg0 consumers contending on the queue lock
+static void bm_dispatch_contended(bench_state* st) {
+    int n = st->arg0;
+    threadpool* tp = create_threadpool(n, MAXW_IN_QUEUE);
+    pthread_t* threads = (pthread_t*)malloc(n * sizeof(pthread_t));
+    producer* producers = (producer*)malloc(n * sizeof(producer));
+    long per_producer = (st->iterations + n - 1) / n;
+    latch l;
+    init_latch(&l, per_producer * n);
+
+    start_timing(st);
+    for (int i = 0; i < n; i++) {
+        producers[i].tp = tp;
+        producers[i].l = &l;
+        producers[i].count = per_producer;
+        pthread_create(&threads[i], NULL, produce, &producers[i]);
+    }
+    for (int i = 0; i < n; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    wait_latch(&l);
+    stop_timing(st);
+
+    st->items = per_producer * n;
+    destroy_threadpool(tp);
+    destroy_latch(&l);
+    free(threads);
+    free(producers);
+}
+
+/* ---- request hot path ---- */
+
+static void bm_get_mime_type(bench_state* st) {
+    static char* names[] = {
+        "index.html", "style.css", "photo.jpeg", "clip.mpg", "song.mp3",
+        "archive.tar.gz", "README", "image.png", "page.htm", "sound.wav"
+    };
+    int n = sizeof(names) / sizeof(names[0]);
+    volatile long found = 0;
+
+    start_timing(st);
+    for (long i = 0; i < st->iterations; i++) {
+        if (get_mime_type(names[i % n]) != NULL) found++;
+    }
+    stop_timing(st);
+    st->items = st->iterations;
+}
+
+// arg0 selects the request line
+static const char* handler_requests[] = {
+    "GET /small.html HTTP/1.1\r\n",
+    "GET /missing.html HTTP/1.1\r\n",
+    "GET /listing/ HTTP/1.0\r\n",
+    "POST /small.html HTTP/1.1\r\n",
+    "GARBAGE\r\n",
+};
+static const char* handler_labels[] = { "file", "not_found", "listing", "not_supported", "bad_request" };
+
+static void bm_request_handler(bench_state* st) {
+    const char* request = handler_requests[st->arg0];
+
+    start_timing(st);
+    for (long i = 0; i < st->iterations; i++) {
+        destroy_response(request_handler(request));
+    }
+    stop_timing(st);
+    st->items = st->iterations;
+}
+
+static void bm_handle_error_response(bench_state* st) {
+    start_timing(st);
+    for (long i = 0; i < st->iterations; i++) {
+        destroy_response(handle_error_response(st->arg0, "/some/dir", NULL));
+    }
+    stop_timing(st);
+    st->items = st->iterations;
+}
+
+// arg0 is the number of entries in the listed directory, arg1 the threads that stat them (0: serial)
+static void bm_generate_directory_listing(bench_state* st) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/tree%d/", fixture_root, st->arg0);
+    listing_pool = st->arg1 > 0 ? create_threadpool(st->arg1, MAXW_IN_QUEUE) : NULL;
+
+    start_timing(st);
+    for (long i = 0; i < st->iterations; i++) {
+        free(generate_directory_listing(path, NULL));
+    }
+    stop_timing(st);
+    st->items = st->iterations * st->arg0;
+
+    destroy_threadpool(listing_pool);
+    listing_pool = NULL;
+}
+
+/* ---- fixtures ---- */
+
+static unsigned long long fixture_rng = FIXTURE_SEED;
+
+static unsigned long long next_random(void) {
+    fixture_rng ^= fixture_rng << 13;
+    fixture_rng ^= fixture_rng >> 7;
+    fixture_rng ^= fixture_rng << 17;
+    return fixture_rng;
+}
+
+static void make_file(const char* path, off_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        exit(1);
+    }
+    if (ftruncate(fd, size) != 0) {
+        perror("ftruncate");
+    }
+    close(fd);
+}
+
+// A directory of "entries" files and subdirectories with seeded names and sizes
+static void make_tree(const char* dir, int entries) {
+    static const char* exts[] = { ".html", ".css", ".png", ".jpg", ".txt", "" };
+    mkdir(dir, 0755);
+    for (int i = 0; i < entries; i++) {
+        char path[PATH_MAX];
+        unsigned long long r = next_random();
+        if (r % 10 == 0) {
+            snprintf(path, sizeof(path), "%s/dir%05d_%04llx", dir, i, r % 0xffff);
+            mkdir(path, 0755);
+        } else {
+            snprintf(path, sizeof(path), "%s/file%05d_%04llx%s", dir, i, r % 0xffff, exts[r % 6]);
+            make_file(path, (off_t)(r % 65536));
+        }
+    }
+}
+
+static void create_fixtures(void) {
+    snprintf(fixture_root, sizeof(fixture_root), "/tmp/webserver-bench-XXXXXX");
+    if (mkdtemp(fixture_root) == NULL) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/small.html", fixture_root);
+    make_file(path, 1024);
+    snprintf(path, sizeof(path), "%s/listing", fixture_root);
+    make_tree(path, 100);
+    snprintf(path, sizeof(path), "%s/tree100", fixture_root);
+    make_tree(path, 100);
+    snprintf(path, sizeof(path), "%s/tree1000", fixture_root);
+    make_tree(path, 1000);
+    snprintf(path, sizeof(path), "%s/tree10000", fixture_root);
+    make_tree(path, 10000);
+
+    // request_handler resolves paths against the working directory
+    if (chdir(fixture_root) != 0) {
+        perror("chdir");
+        exit(1);
+    }
+}
+
+static void remove_tree(const char* dir) {
+    DIR* d = opendir(dir);
+    if (d == NULL) return;
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        struct stat st;
+        if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+            remove_tree(path);
+        } else {
+            unlink(path);
+        }
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+/* ---- runner ---- */
+
+static void register_all(void) {
+    static const int thread_counts[] = { 1, 2, 4, 8, 16 };
+    static const int queue_sizes[] = { 1, 16, MAXW_IN_QUEUE };
+    int nthreads = sizeof(thread_counts) / sizeof(thread_counts[0]);
+    int nqueues = sizeof(queue_sizes) / sizeof(queue_sizes[0]);
+
+    for (int t = 0; t < nthreads; t++) {
+        register_benchmark(bm_dispatch_roundtrip, thread_counts[t], 0,
+                           "BM_dispatch_roundtrip/threads:%d", thread_counts[t]);
+    }
+    for (int t = 0; t < nthreads; t++) {
+        for (int q = 0; q < nqueues; q++) {
+            register_benchmark(bm_dispatch_throughput, thread_counts[t], queue_sizes[q],
+                               "BM_dispatch_throughput/threads:%d/max_queue:%d",
+                               thread_counts[t], queue_sizes[q]);
+        }
+    }
+    for (int t = 0; t < nthreads; t++) {
+        register_benchmark(bm_dispatch_batch_throughput, thread_counts[t], 32,
+                           "BM_dispatch_batch_throughput/threads:%d/batch:32", thread_counts[t]);
+    }
+    for (int t = 1; t < nthreads; t++) {
+        register_benchmark(bm_dispatch_contended, thread_counts[t], 0,
+                           "BM_dispatch_contended/producers:%d/threads:%d",
+                           thread_counts[t], thread_counts[t]);
+    }
+    register_benchmark(bm_get_mime_type, 0, 0, "BM_get_mime_type");
+    for (int i = 0; i < (int)(sizeof(handler_labels) / sizeof(handler_labels[0])); i++) {
+        register_benchmark(bm_request_handler, i, 0, "BM_request_handler/%s", handler_labels[i]);
+    }
+    register_benchmark(bm_handle_error_response, 404, 0, "BM_handle_error_response/404");
+    register_benchmark(bm_handle_error_response, 302, 0, "BM_handle_error_response/302");
+    register_benchmark(bm_generate_directory_listing, 100, 0, "BM_generate_directory_listing/entries:100");
+    register_benchmark(bm_generate_directory_listing, 1000, 0, "BM_generate_directory_listing/entries:1000");
+    register_benchmark(bm_generate_directory_listing, 10000, 0, "BM_generate_directory_listing/entries:10000");
+    register_benchmark(bm_generate_directory_listing, 10000, 4, "BM_generate_directory_listing/entries:10000/threads:4");
+}
+
+// Grows the iteration count until one run takes MIN_TIME_NS
+static void run_benchmark(const benchmark* b, bench_state* st) {
+    long iterations = 1;
+    while (1) {
+        memset(st, 0, sizeof(bench_state));
+        st->iterations = iterations;
+        st->arg0 = b->arg0;
+        st->arg1 = b->arg1;
+        b->fn(st);
+        if (st->real_ns >= MIN_TIME_NS || iterations >= MAX_ITERATIONS) {
+            return;
+        }
+        double scale = st->real_ns > 0 ? 1.4 * MIN_TIME_NS / st->real_ns : 10.0;
+        if (scale > 10.0) scale = 10.0;
+        long next = (long)(iterations * scale);
+        iterations = next > iterations ? next : iterations + 1;
+    }
+}
+
+int main(int argc, char* argv[]){
+    int json = 0;
+    const char* filter = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            json = 1;
+        } else if (argv[i][0] != '-') {
+            filter = argv[i];
+        } else {
+            printf("Usage: bench [--json] [name-filter]\n");
+            exit(1);
+        }
+    }
+
+    register_all();
+    create_fixtures();
+
+    if (json) {
+        char date[64];
+        time_t now = time(NULL);
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+        printf("{\n  \"context\": {\n"
+               "    \"date\": \"%s\",\n"
+               "    \"executable\": \"%s\",\n"
+               "    \"num_cpus\": %ld,\n"
+               "    \"library_build_type\": \"release\"\n"
+               "  },\n  \"benchmarks\": [",
+               date, argv[0], sysconf(_SC_NPROCESSORS_ONLN));
+    } else {
+        printf("%-52s %14s %14s %12s %14s\n", "Benchmark", "Time", "CPU", "Iterations", "items/s");
+    }
+
+    int printed = 0;
+    for (int i = 0; i < benchmark_count; i++) {
+        const benchmark* b = &benchmarks[i];
+        if (filter != NULL && strstr(b->name, filter) == NULL) {
+            continue;
+        }
+
+        bench_state st;
+        run_benchmark(b, &st);
+        double real = (double)st.real_ns / st.iterations;
+        double cpu = (double)st.cpu_ns / st.iterations;
+        double items_per_second = st.real_ns > 0 ? st.items * 1e9 / st.real_ns : 0;
+
+        if (json) {
+            printf("%s\n    {\n"
+                   "      \"name\": \"%s\",\n"
+                   "      \"run_name\": \"%s\",\n"
+                   "      \"run_type\": \"iteration\",\n"
+                   "      \"iterations\": %ld,\n"
+                   "      \"real_time\": %.3f,\n"
+                   "      \"cpu_time\": %.3f,\n"
+                   "      \"time_unit\": \"ns\",\n"
+                   "      \"items_per_second\": %.3f\n"
+                   "    }",
+                   printed ? "," : "", b->name, b->name, st.iterations, real, cpu, items_per_second);
+        } else {
+            printf("%-52s %11.1f ns %11.1f ns %12ld %14.0f\n",
+                   b->name, real, cpu, st.iterations, items_per_second);
+        }
+        fflush(stdout);
+        printed++;
+    }
+
+    if (json) {
+        printf("\n  ]\n}\n");
+    }
+    remove_tree(fixture_root);
+    return 0;
+}
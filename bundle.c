@@ -0,0 +1,429 @@
+#include "bundle.h"
+#include "mime.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+// A file found while walking the docroot
+typedef struct pack_file_st {
+    char* url;          //request path, starts with '/'
+    char* fs_path;
+    char* gz_path;      //NULL if there is no gzip variant
+    int alias;          //index of the entry this one shares bodies with, or -1
+    bundle_entry entry;
+} pack_file;
+
+typedef struct pack_list_st {
+    pack_file* files;
+    int count;
+    int cap;
+    char* strings;
+    size_t strings_len;
+    size_t strings_cap;
+} pack_list;
+
+uint64_t hash_bundle_path(const char* path, size_t len) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)path[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static int is_regular(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+static int add_file(pack_list* list, const char* url, const char* fs_path, int alias) {
+    if (list->count == list->cap) {
+        int cap = list->cap ? list->cap * 2 : 256;
+        pack_file* bigger = (pack_file*)realloc(list->files, cap * sizeof(pack_file));
+        if (bigger == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        list->files = bigger;
+        list->cap = cap;
+    }
+
+    pack_file* f = &list->files[list->count];
+    memset(f, 0, sizeof(pack_file));
+    f->url = strdup(url);
+    f->fs_path = strdup(fs_path);
+    f->alias = alias;
+    if (f->url == NULL || f->fs_path == NULL) {
+        perror("strdup");
+        free(f->url);
+        free(f->fs_path);
+        return -1;
+    }
+
+    char gz_path[PATH_MAX];
+    snprintf(gz_path, sizeof(gz_path), "%s.gz", fs_path);
+    if (is_regular(gz_path)) {
+        f->gz_path = strdup(gz_path);
+    }
+    return list->count++;
+}
+
+// Walks "dir" (request path "url", ending with '/') and collects its files
+static int collect(pack_list* list, const char* dir, const char* url) {
+    DIR* d = opendir(dir);
+    if (d == NULL) {
+        perror("opendir");
+        return -1;
+    }
+
+    int index_html = -1;
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+            continue;
+        }
+
+        char fs_path[PATH_MAX];
+        char child_url[PATH_MAX];
+        snprintf(fs_path, sizeof(fs_path), "%s/%s", dir, entry->d_name);
+        snprintf(child_url, sizeof(child_url), "%s%s", url, entry->d_name);
+
+        struct stat st;
+        if (stat(fs_path, &st) != 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            strncat(child_url, "/", sizeof(child_url) - strlen(child_url) - 1);
+            if (collect(list, fs_path, child_url) < 0) {
+                closedir(d);
+                return -1;
+            }
+            continue;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            continue;
+        }
+
+        // "name.gz" next to "name" is a variant, not a file of its own
+        size_t len = strlen(fs_path);
+        if (len > 3 && strcmp(fs_path + len - 3, ".gz") == 0) {
+            fs_path[len - 3] = '\0';
+            int has_base = is_regular(fs_path);
+            fs_path[len - 3] = '.';
+            if (has_base) {
+                continue;
+            }
+        }
+
+        int idx = add_file(list, child_url, fs_path, -1);
+        if (idx < 0) {
+            closedir(d);
+            return -1;
+        }
+        if (strcmp(entry->d_name, "index.html") == 0) {
+            index_html = idx;
+        }
+    }
+    closedir(d);
+
+    // The directory itself serves its index.html (copy the path, add_file may move the list)
+    if (index_html >= 0) {
+        char index_path[PATH_MAX];
+        snprintf(index_path, sizeof(index_path), "%s", list->files[index_html].fs_path);
+        if (add_file(list, url, index_path, index_html) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int add_string(pack_list* list, const char* s, size_t len, uint32_t* off) {
+    if (list->strings_len + len > list->strings_cap) {
+        size_t cap = list->strings_cap ? list->strings_cap * 2 : 65536;
+        while (cap < list->strings_len + len) cap *= 2;
+        char* bigger = (char*)realloc(list->strings, cap);
+        if (bigger == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        list->strings = bigger;
+        list->strings_cap = cap;
+    }
+    memcpy(list->strings + list->strings_len, s, len);
+    *off = (uint32_t)list->strings_len;
+    list->strings_len += len;
+    return 0;
+}
+
+// Copies "path" into "out" at the next page boundary, returns the body hash for the ETag
+static int copy_body(FILE* out, const char* path, uint64_t* off, uint64_t* len, uint64_t* hash) {
+    FILE* in = fopen(path, "rb");
+    if (in == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    long pos = ftell(out);
+    long aligned = (pos + BUNDLE_ALIGN - 1) & ~(long)(BUNDLE_ALIGN - 1);
+    while (pos < aligned) {
+        fputc(0, out);
+        pos++;
+    }
+
+    char buf[65536];
+    size_t n;
+    *off = (uint64_t)aligned;
+    *len = 0;
+    *hash = 14695981039346656037ULL;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        for (size_t i = 0; i < n; i++) {
+            *hash ^= (unsigned char)buf[i];
+            *hash *= 1099511628211ULL;
+        }
+        if (fwrite(buf, 1, n, out) != n) {
+            perror("fwrite");
+            fclose(in);
+            return -1;
+        }
+        *len += n;
+    }
+    fclose(in);
+    return 0;
+}
+
+// "vary" is set on both variants of a file that has a gzip variant
+static int add_headers(pack_list* list, const char* mime_type, uint64_t len, uint64_t etag,
+                       const char* encoding, int vary, uint32_t* off, uint32_t* headers_len) {
+    char headers[512];
+    int n = 0;
+    if (mime_type != NULL) {
+        n += snprintf(headers + n, sizeof(headers) - n, "Content-Type: %s\r\n", mime_type);
+    }
+    if (encoding != NULL) {
+        n += snprintf(headers + n, sizeof(headers) - n, "Content-Encoding: %s\r\n", encoding);
+    }
+    if (vary) {
+        n += snprintf(headers + n, sizeof(headers) - n, "Vary: Accept-Encoding\r\n");
+    }
+    n += snprintf(headers + n, sizeof(headers) - n,
+                  "Content-Length: %" PRIu64 "\r\n"
+                  "ETag: \"%016" PRIx64 "\"\r\n", len, etag);
+    *headers_len = (uint32_t)n;
+    return add_string(list, headers, n, off);
+}
+
+static int compare_entries(const void* a, const void* b) {
+    const bundle_entry* x = (const bundle_entry*)a;
+    const bundle_entry* y = (const bundle_entry*)b;
+    if (x->hash == y->hash) return 0;
+    return x->hash < y->hash ? -1 : 1;
+}
+
+static void free_list(pack_list* list) {
+    for (int i = 0; i < list->count; i++) {
+        free(list->files[i].url);
+        free(list->files[i].fs_path);
+        free(list->files[i].gz_path);
+    }
+    free(list->files);
+    free(list->strings);
+}
+
+int build_bundle(const char* docroot, const char* out_path) {
+    pack_list list;
+    memset(&list, 0, sizeof(list));
+    if (collect(&list, docroot, "/") < 0) {
+        free_list(&list);
+        return -1;
+    }
+
+    FILE* out = fopen(out_path, "wb");
+    if (out == NULL) {
+        perror(out_path);
+        free_list(&list);
+        return -1;
+    }
+    bundle_header header;
+    memset(&header, 0, sizeof(header));
+    fwrite(&header, sizeof(header), 1, out);
+
+    bundle_entry* index = (bundle_entry*)calloc(list.count ? list.count : 1, sizeof(bundle_entry));
+    if (index == NULL) {
+        perror("calloc");
+        goto fail;
+    }
+
+    for (int i = 0; i < list.count; i++) {
+        pack_file* f = &list.files[i];
+        bundle_entry* e = &f->entry;
+        uint64_t etag = 0, gz_etag = 0;
+
+        if (f->alias >= 0) {
+            // Same file as an earlier entry, share its bodies and headers
+            *e = list.files[f->alias].entry;
+        } else {
+            if (copy_body(out, f->fs_path, &e->body_off, &e->body_len, &etag) < 0) {
+                goto fail;
+            }
+            if (f->gz_path != NULL &&
+                copy_body(out, f->gz_path, &e->gz_body_off, &e->gz_body_len, &gz_etag) < 0) {
+                goto fail;
+            }
+
+            char* mime_type = get_mime_type(f->fs_path);
+            if (add_headers(&list, mime_type, e->body_len, etag, NULL, f->gz_path != NULL,
+                            &e->headers_off, &e->headers_len) < 0) {
+                goto fail;
+            }
+            if (f->gz_path != NULL &&
+                add_headers(&list, mime_type, e->gz_body_len, gz_etag, "gzip", 1,
+                            &e->gz_headers_off, &e->gz_headers_len) < 0) {
+                goto fail;
+            }
+        }
+
+        e->path_len = (uint32_t)strlen(f->url);
+        e->hash = hash_bundle_path(f->url, e->path_len);
+        if (add_string(&list, f->url, e->path_len, &e->path_off) < 0) {
+            goto fail;
+        }
+        index[i] = *e;
+    }
+    qsort(index, list.count, sizeof(bundle_entry), compare_entries);
+
+    long pos = ftell(out);
+    while (pos % 8 != 0) {
+        fputc(0, out);
+        pos++;
+    }
+    memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+    header.version = BUNDLE_VERSION;
+    header.count = (uint32_t)list.count;
+    header.index_off = (uint64_t)pos;
+    header.strings_off = header.index_off + (uint64_t)list.count * sizeof(bundle_entry);
+    header.size = header.strings_off + list.strings_len;
+
+    if (fwrite(index, sizeof(bundle_entry), list.count, out) != (size_t)list.count ||
+        fwrite(list.strings, 1, list.strings_len, out) != list.strings_len ||
+        fseek(out, 0, SEEK_SET) != 0 ||
+        fwrite(&header, sizeof(header), 1, out) != 1) {
+        perror("fwrite");
+        goto fail;
+    }
+    if (fclose(out) != 0) {
+        perror("fclose");
+        out = NULL;
+        goto fail;
+    }
+
+    int count = list.count;
+    free(index);
+    free_list(&list);
+    return count;
+
+fail:
+    if (out != NULL) fclose(out);
+    free(index);
+    free_list(&list);
+    return -1;
+}
+
+bundle* open_bundle(const char* file) {
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(file);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(bundle_header)) {
+        printf("%s is not a bundle\n", file);
+        close(fd);
+        return NULL;
+    }
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+
+    const bundle_header* header = (const bundle_header*)map;
+    if (memcmp(header->magic, BUNDLE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != BUNDLE_VERSION ||
+        header->size != (uint64_t)st.st_size ||
+        header->index_off + (uint64_t)header->count * sizeof(bundle_entry) != header->strings_off ||
+        header->strings_off > header->size) {
+        printf("%s is not a valid bundle\n", file);
+        munmap(map, st.st_size);
+        return NULL;
+    }
+
+    const bundle_entry* index = (const bundle_entry*)((const char*)map + header->index_off);
+    uint64_t strings_len = header->size - header->strings_off;
+    for (uint32_t i = 0; i < header->count; i++) {
+        const bundle_entry* e = &index[i];
+        if ((uint64_t)e->path_off + e->path_len > strings_len ||
+            (uint64_t)e->headers_off + e->headers_len > strings_len ||
+            (uint64_t)e->gz_headers_off + e->gz_headers_len > strings_len ||
+            e->body_off + e->body_len > header->size ||
+            e->gz_body_off + e->gz_body_len > header->size) {
+            printf("%s has a corrupt index entry\n", file);
+            munmap(map, st.st_size);
+            return NULL;
+        }
+    }
+
+    bundle* b = (bundle*)malloc(sizeof(bundle));
+    if (b == NULL) {
+        perror("malloc");
+        munmap(map, st.st_size);
+        return NULL;
+    }
+    b->map = map;
+    b->size = st.st_size;
+    b->header = header;
+    b->index = index;
+    b->strings = (const char*)map + header->strings_off;
+
+    // The index is touched on every request, fault it in now
+    madvise((char*)map + (header->index_off & ~(uint64_t)(BUNDLE_ALIGN - 1)),
+            header->size - (header->index_off & ~(uint64_t)(BUNDLE_ALIGN - 1)), MADV_WILLNEED);
+    return b;
+}
+
+const bundle_entry* find_in_bundle(const bundle* b, const char* path, size_t len) {
+    uint64_t hash = hash_bundle_path(path, len);
+
+    // First entry with this hash
+    uint32_t lo = 0, hi = b->header->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (b->index[mid].hash < hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    for (uint32_t i = lo; i < b->header->count && b->index[i].hash == hash; i++) {
+        const bundle_entry* e = &b->index[i];
+        if (e->path_len == len && memcmp(b->strings + e->path_off, path, len) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+void close_bundle(bundle* b) {
+    if (b == NULL) return;
+    munmap(b->map, b->size);
+    free(b);
+}
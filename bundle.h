@@ -0,0 +1,88 @@
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ * bundle.h
+ *
+ * This file declares the packed static asset bundle: a docroot
+ * packed into one indexed file that the server maps at startup
+ * and serves without touching the filesystem.
+ *
+ * Layout:
+ *   bundle_header | bodies (each page aligned) | index | strings
+ * The index is sorted by the hash of the request path. The strings
+ * area holds the paths and the precomputed header lines.
+ */
+
+#define BUNDLE_MAGIC "WSBUNDL1"
+#define BUNDLE_VERSION 1
+#define BUNDLE_ALIGN 4096
+
+typedef struct bundle_header_st {
+    char magic[8];          //BUNDLE_MAGIC, not null terminated
+    uint32_t version;
+    uint32_t count;         //number of index entries
+    uint64_t index_off;     //offset of the sorted index
+    uint64_t strings_off;   //offset of the strings area
+    uint64_t size;          //total size of the file
+} bundle_header;
+
+/**
+ * One servable path. Offsets of strings are relative to strings_off,
+ * offsets of bodies are absolute and page aligned.
+ * gz_body_len is 0 when there is no gzip variant.
+ */
+typedef struct bundle_entry_st {
+    uint64_t hash;          //hash_bundle_path of the request path
+    uint32_t path_off;
+    uint32_t path_len;
+    uint32_t headers_off;   //"Content-Type", "Content-Length" and "ETag" lines
+    uint32_t headers_len;
+    uint32_t gz_headers_off;
+    uint32_t gz_headers_len;
+    uint64_t body_off;
+    uint64_t body_len;
+    uint64_t gz_body_off;
+    uint64_t gz_body_len;
+} bundle_entry;
+
+/**
+ * A mapped bundle
+ */
+typedef struct bundle_st {
+    void* map;
+    size_t size;
+    const bundle_header* header;
+    const bundle_entry* index;
+    const char* strings;
+} bundle;
+
+/**
+ * hash_bundle_path hashes "len" bytes of a request path (64 bit FNV-1a).
+ */
+uint64_t hash_bundle_path(const char* path, size_t len);
+
+/**
+ * build_bundle packs every regular file under "docroot" into "out".
+ * A "name.gz" next to "name" is stored as its gzip variant, and
+ * directories with an index.html are also reachable as "dir/".
+ * Returns the number of entries written, or -1 on error.
+ */
+int build_bundle(const char* docroot, const char* out);
+
+/**
+ * open_bundle maps and validates a bundle file.
+ * If the function succeeds, it returns a (non-NULL) "bundle", else it returns NULL.
+ */
+bundle* open_bundle(const char* file);
+
+/**
+ * find_in_bundle looks up the first "len" bytes of a request path
+ * (e.g. "/dir/page.html"). Returns NULL if the path is not in the bundle.
+ */
+const bundle_entry* find_in_bundle(const bundle* b, const char* path, size_t len);
+
+/**
+ * close_bundle unmaps the bundle and frees it.
+ */
+void close_bundle(bundle* b);
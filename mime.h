@@ -0,0 +1,12 @@
+/**
+ * mime.h
+ *
+ * This file declares the MIME type lookup shared by the server
+ * and the bundle tool.
+ */
+
+/**
+ * get_mime_type returns the MIME type for the extension of "name",
+ * or NULL if the extension is unknown.
+ */
+char *get_mime_type(char *name);
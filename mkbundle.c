@@ -0,0 +1,19 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "bundle.h"
+
+// Packs a docroot into a bundle file for the server's WEBSERVER_BUNDLE mode
+int main(int argc, char* argv[]){
+    if(argc != 3){
+        printf("Usage: mkbundle <docroot> <bundle-file>\n");
+        exit(1);
+    }
+
+    int count = build_bundle(argv[1], argv[2]);
+    if (count < 0) {
+        printf("Failed to build %s\n", argv[2]);
+        return 1;
+    }
+    printf("Packed %d paths from %s into %s\n", count, argv[1], argv[2]);
+    return 0;
+}
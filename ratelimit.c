@@ -0,0 +1,188 @@
+#include "ratelimit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#define RL_MASK (RL_SLOTS - 1)
+#define RL_TOKEN 1000ULL        //one token, in thousandths
+
+// Milliseconds on a monotonic clock, wrapping at 32 bits like the bucket timestamps
+static unsigned int now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (unsigned int)(ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000);
+}
+
+static unsigned long long pack_state(unsigned long long tokens, unsigned int ms) {
+    unsigned long long state = tokens << 32 | ms;
+    return state != 0 ? state : 1; // 0 is reserved for a new bucket
+}
+
+ratelimiter* create_ratelimiter(unsigned int rate, unsigned int burst) {
+    // The tokens of a full bucket have to fit in 32 bits, and a refill
+    // (up to 2^32 ms times the rate) in 64
+    if (rate == 0 || burst == 0 || rate > RL_MAX_LIMIT || burst > RL_MAX_LIMIT) {
+        fprintf(stderr, "Invalid rate limit %u/%u\n", rate, burst);
+        return NULL;
+    }
+
+    ratelimiter* rl = (ratelimiter*)malloc(sizeof(ratelimiter));
+    if (rl == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    rl->shards = (rl_shard*)aligned_alloc(64, RL_SHARDS * sizeof(rl_shard));
+    if (rl->shards == NULL) {
+        perror("aligned_alloc");
+        free(rl);
+        return NULL;
+    }
+    memset(rl->shards, 0, RL_SHARDS * sizeof(rl_shard));
+    rl->rate = rate;
+    rl->burst = burst;
+    return rl;
+}
+
+unsigned long long client_key(const struct sockaddr_storage* addr, int v4_bits, int v6_bits) {
+    const unsigned char* bytes;
+    int len;
+    int family = addr->ss_family;
+    int prefix_bits = family == AF_INET ? v4_bits : v6_bits;
+
+    if (family == AF_INET) {
+        bytes = (const unsigned char*)&((const struct sockaddr_in*)addr)->sin_addr;
+        len = 4;
+    } else if (family == AF_INET6) {
+        const struct in6_addr* a6 = &((const struct sockaddr_in6*)addr)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(a6)) {
+            // The same client whether it came in over IPv4 or a dual-stack socket
+            bytes = a6->s6_addr + 12;
+            len = 4;
+            family = AF_INET;
+            prefix_bits = v4_bits;
+        } else {
+            bytes = a6->s6_addr;
+            len = 16;
+        }
+    } else {
+        bytes = NULL;
+        len = 0;
+    }
+    if (prefix_bits < 0) prefix_bits = 0;
+    if (prefix_bits > len * 8) prefix_bits = len * 8;
+
+    // FNV-1a over the family, the prefix length and the masked address
+    unsigned long long hash = 14695981039346656037ULL;
+    hash = (hash ^ (unsigned char)family) * 1099511628211ULL;
+    hash = (hash ^ (unsigned char)prefix_bits) * 1099511628211ULL;
+    for (int i = 0; i < len; i++) {
+        int bits = prefix_bits - i * 8;
+        unsigned char mask = bits >= 8 ? 0xff : bits <= 0 ? 0 : (unsigned char)(0xff << (8 - bits));
+        hash = (hash ^ (bytes[i] & mask)) * 1099511628211ULL;
+    }
+    return hash != 0 ? hash : 1; // 0 marks a free slot
+}
+
+// Finds the bucket of "key", claiming a free or stale slot for a new key
+static rl_bucket* find_bucket(ratelimiter* rl, unsigned long long key, unsigned int now) {
+    rl_shard* shard = &rl->shards[(key >> 48) % RL_SHARDS];
+    unsigned int start = (unsigned int)key & RL_MASK;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        rl_bucket* free_slot = NULL;
+        rl_bucket* stalest = NULL;
+        unsigned int stalest_idle = 0;
+
+        for (int i = 0; i < RL_PROBE; i++) {
+            rl_bucket* b = &shard->buckets[(start + i) & RL_MASK];
+            unsigned long long k = __atomic_load_n(&b->key, __ATOMIC_ACQUIRE);
+            if (k == key) {
+                return b;
+            }
+            if (k == 0) {
+                if (free_slot == NULL) free_slot = b;
+                continue;
+            }
+            unsigned long long state = __atomic_load_n(&b->state, __ATOMIC_RELAXED);
+            unsigned int idle = now - (unsigned int)state;
+            if (state != 0 && idle >= RL_IDLE_MS && idle >= stalest_idle) {
+                stalest = b;
+                stalest_idle = idle;
+            }
+        }
+
+        // The key is not in its window: take a free slot, or else the stalest one
+        unsigned long long expected = 0;
+        rl_bucket* b = free_slot;
+        if (b == NULL && stalest != NULL) {
+            b = stalest;
+            expected = __atomic_load_n(&b->key, __ATOMIC_RELAXED);
+        }
+        if (b == NULL) {
+            return NULL;
+        }
+        if (__atomic_compare_exchange_n(&b->key, &expected, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            if (b == stalest) {
+                __atomic_store_n(&b->state, 0, __ATOMIC_RELEASE);
+            }
+            return b;
+        }
+        // Another thread took the slot, maybe for this same key: look again
+    }
+    return NULL;
+}
+
+int rate_limit_allow(ratelimiter* rl, unsigned long long key) {
+    unsigned int now = now_ms();
+    rl_bucket* b = find_bucket(rl, key, now);
+    if (b == NULL) {
+        return 1; // Table full of active clients, let it through
+    }
+
+    unsigned long long full = rl->burst * RL_TOKEN;
+    unsigned long long state = __atomic_load_n(&b->state, __ATOMIC_ACQUIRE);
+    for (;;) {
+        // Refill for the time since the last token was taken
+        unsigned long long tokens = full;
+        if (state != 0) {
+            unsigned long long elapsed = (unsigned int)(now - (unsigned int)state);
+            tokens = (state >> 32) + elapsed * rl->rate;
+            if (tokens > full) tokens = full;
+        }
+        if (tokens < RL_TOKEN) {
+            return 0;
+        }
+        unsigned long long next = pack_state(tokens - RL_TOKEN, now);
+        if (__atomic_compare_exchange_n(&b->state, &state, next, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return 1;
+        }
+    }
+}
+
+void age_ratelimiter(ratelimiter* rl) {
+    unsigned int now = now_ms();
+    for (int s = 0; s < RL_SHARDS; s++) {
+        for (int i = 0; i < RL_SLOTS; i++) {
+            rl_bucket* b = &rl->shards[s].buckets[i];
+            unsigned long long key = __atomic_load_n(&b->key, __ATOMIC_ACQUIRE);
+            unsigned long long state = __atomic_load_n(&b->state, __ATOMIC_ACQUIRE);
+            if (key == 0 || state == 0 || now - (unsigned int)state < RL_IDLE_MS) {
+                continue;
+            }
+            // Reset the bucket first, so a request that races in finds a full one
+            if (__atomic_compare_exchange_n(&b->state, &state, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                __atomic_compare_exchange_n(&b->key, &key, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+void destroy_ratelimiter(ratelimiter* rl) {
+    if (rl == NULL) {
+        return;
+    }
+    free(rl->shards);
+    free(rl);
+}
@@ -0,0 +1,72 @@
+#include <sys/socket.h>
+
+/**
+ * ratelimit.h
+ *
+ * This file declares the per-client rate limiter: token buckets kept
+ * in a sharded open-addressing hash table and updated with atomic
+ * compare-and-swap only, so checking a client never takes a lock.
+ * Buckets refill lazily when they are checked, and age_ratelimiter
+ * frees the slots of clients that have gone quiet.
+ *
+ * It is best effort: when the table is full of active clients new
+ * ones are let through, and a race between aging and a request can
+ * give one client a freshly filled bucket.
+ */
+
+#define RL_SHARDS 16
+#define RL_SLOTS 2048           //slots per shard, a power of 2
+#define RL_PROBE 8              //slots searched for a key
+#define RL_IDLE_MS 60000        //untouched this long, a bucket can be reused
+#define RL_MAX_LIMIT 4294967    //largest rate or burst, a full bucket's thousandths fit in 32 bits
+
+/**
+ * One bucket. state packs the tokens left, in thousandths, in the
+ * high 32 bits and the time of the last refill (ms) in the low 32 bits.
+ * A state of 0 means a new bucket, which starts full.
+ */
+typedef struct rl_bucket_st {
+    unsigned long long key;     //client fingerprint, 0 if the slot is free
+    unsigned long long state;
+} rl_bucket;
+
+typedef struct rl_shard_st {
+    rl_bucket buckets[RL_SLOTS];
+} __attribute__((aligned(64))) rl_shard;
+
+typedef struct ratelimiter_st {
+    rl_shard* shards;
+    unsigned int rate;          //tokens added per second
+    unsigned int burst;         //bucket size
+} ratelimiter;
+
+/**
+ * create_ratelimiter creates a limiter that lets each client through
+ * "rate" times per second on average and "burst" times in a row,
+ * both between 1 and RL_MAX_LIMIT.
+ * If the function succeeds, it returns a (non-NULL) "ratelimiter", else it returns NULL.
+ */
+ratelimiter* create_ratelimiter(unsigned int rate, unsigned int burst);
+
+/**
+ * client_key returns the fingerprint of the first "v4_bits" bits of an
+ * IPv4 address, or "v6_bits" of an IPv6 one (32/128 for the host,
+ * 24/64 for its network). IPv4-mapped IPv6 addresses count as IPv4.
+ */
+unsigned long long client_key(const struct sockaddr_storage* addr, int v4_bits, int v6_bits);
+
+/**
+ * rate_limit_allow takes a token from the bucket of "key".
+ * Returns 1 if the client may go on, 0 if it is over its limit.
+ */
+int rate_limit_allow(ratelimiter* rl, unsigned long long key);
+
+/**
+ * age_ratelimiter frees the buckets that have not been used for RL_IDLE_MS.
+ */
+void age_ratelimiter(ratelimiter* rl);
+
+/**
+ * destroy_ratelimiter frees the limiter.
+ */
+void destroy_ratelimiter(ratelimiter* rl);
@@ -0,0 +1,133 @@
+#include "response.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+response_t* create_response(void) {
+    response_t* r = (response_t*)malloc(sizeof(response_t));
+    if (r == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    r->count = 0;
+    return r;
+}
+
+int add_buffer(response_t* r, const char* data, size_t len, int owned) {
+    if (r->count == MAX_SEGMENTS) {
+        if (owned) free((void*)data);
+        return -1;
+    }
+    segment_t* seg = &r->segments[r->count++];
+    seg->data = data;
+    seg->fd = -1;
+    seg->offset = 0;
+    seg->len = len;
+    seg->owned = owned;
+    return 0;
+}
+
+int add_file(response_t* r, int fd, off_t offset, size_t len, int owned) {
+    if (r->count == MAX_SEGMENTS) {
+        if (owned) close(fd);
+        return -1;
+    }
+    segment_t* seg = &r->segments[r->count++];
+    seg->data = NULL;
+    seg->fd = fd;
+    seg->offset = offset;
+    seg->len = len;
+    seg->owned = owned;
+    return 0;
+}
+
+size_t response_length(const response_t* r) {
+    size_t len = 0;
+    for (int i = 0; i < r->count; i++) {
+        len += r->segments[i].len;
+    }
+    return len;
+}
+
+int send_response(response_t* r, int socket) {
+    // Fails on anything but TCP, the response is still sent, just uncorked
+    int cork = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+
+    int rc = 0;
+    int i = 0;          //current segment
+    size_t done = 0;    //bytes of the current segment already sent
+    while (1) {
+        // Skip the segments that are fully sent
+        while (i < r->count && done >= r->segments[i].len) {
+            done -= r->segments[i].len;
+            i++;
+        }
+        if (i == r->count) {
+            break;
+        }
+
+        ssize_t n;
+        segment_t* seg = &r->segments[i];
+        if (seg->data == NULL) {
+            off_t offset = seg->offset + done;
+            n = sendfile(socket, seg->fd, &offset, seg->len - done);
+            if (n == 0) {
+                printf("file shrank while being sent\n");
+                rc = -1;
+                break;
+            }
+        } else {
+            // Gather the run of memory segments into one call
+            struct iovec iov[MAX_SEGMENTS];
+            int iovcnt = 0;
+            for (int j = i; j < r->count && r->segments[j].data != NULL; j++) {
+                size_t skip = (j == i) ? done : 0;
+                iov[iovcnt].iov_base = (char*)r->segments[j].data + skip;
+                iov[iovcnt].iov_len = r->segments[j].len - skip;
+                iovcnt++;
+            }
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iovcnt;
+            n = sendmsg(socket, &msg, MSG_NOSIGNAL | (i + iovcnt < r->count ? MSG_MORE : 0));
+        }
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            // The client going away (EPIPE, ECONNRESET) is an ordinary failure, not worth a log line
+            if (errno != EPIPE && errno != ECONNRESET) {
+                perror("send");
+            }
+            rc = -1;
+            break;
+        }
+        done += n;
+    }
+
+    cork = 0;
+    setsockopt(socket, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+    return rc;
+}
+
+void destroy_response(response_t* r) {
+    if (r == NULL) return;
+    for (int i = 0; i < r->count; i++) {
+        segment_t* seg = &r->segments[i];
+        if (!seg->owned) continue;
+        if (seg->data != NULL) {
+            free((void*)seg->data);
+        } else {
+            close(seg->fd);
+        }
+    }
+    free(r);
+}
@@ -0,0 +1,68 @@
+#include <sys/types.h>
+
+/**
+ * response.h
+ *
+ * This file declares a response made of segments (status line,
+ * header blocks, body slices, file ranges) that is sent without
+ * first being copied into one buffer.
+ */
+
+// maximum number of segments in one response
+#define MAX_SEGMENTS 16
+
+/**
+ * A slice of memory, or a range of a file when data is NULL.
+ * Owned segments are freed (or closed) by destroy_response.
+ */
+typedef struct segment_st {
+    const char* data;   //memory to send, NULL for a file range
+    int fd;             //file to send from when data is NULL
+    off_t offset;       //start of the range in the file
+    size_t len;
+    int owned;          //1 if destroy_response frees data / closes fd
+} segment_t;
+
+typedef struct response_st {
+    segment_t segments[MAX_SEGMENTS];
+    int count;
+} response_t;
+
+/**
+ * create_response returns an empty response, or NULL on error.
+ */
+response_t* create_response(void);
+
+/**
+ * add_buffer appends "len" bytes at "data". If "owned" is 1 the
+ * response takes the buffer (it is freed even if the call fails).
+ * Returns 0 on success, -1 if the response is full.
+ */
+int add_buffer(response_t* r, const char* data, size_t len, int owned);
+
+/**
+ * add_file appends "len" bytes of "fd" starting at "offset". If "owned"
+ * is 1 the response takes the descriptor (it is closed even if the call fails).
+ * Returns 0 on success, -1 if the response is full.
+ */
+int add_file(response_t* r, int fd, off_t offset, size_t len, int owned);
+
+/**
+ * response_length returns the total number of bytes in the response.
+ */
+size_t response_length(const response_t* r);
+
+/**
+ * send_response writes every segment to "socket", resuming after
+ * partial writes. The socket is corked meanwhile so headers and the
+ * start of the body leave in full segments.
+ * File ranges go out with sendfile, which raises SIGPIPE when the client
+ * has gone away: the process has to ignore SIGPIPE (main does).
+ * Returns 0 on success, -1 if the socket failed.
+ */
+int send_response(response_t* r, int socket);
+
+/**
+ * destroy_response frees the owned segments and the response.
+ */
+void destroy_response(response_t* r);
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,30 +8,96 @@
 #include <sys/stat.h>
 #include <stdbool.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include "threadpool.h"
+#include "mime.h"
+#include "bundle.h"
+#include "response.h"
+#include "timerwheel.h"
+#include "trace.h"
+#include "ratelimit.h"
 
 #define BUFFER_SIZE 4000
 #define RFC1123FMT "%a, %d %b %Y %H:%M:%S GMT"
-#define RESPONSE_SIZE 65535
-time_t now;
-char timebuf[128];
-
-char *get_mime_type(char *name) {
-    char *ext = strrchr(name, '.');
-    if (!ext) return NULL;
-    if (strcmp(ext, ".html") == 0 || strcmp(ext, ".htm") == 0) return "text/html";
-    if (strcmp(ext, ".jpg") == 0 || strcmp(ext, ".jpeg") == 0) return "image/jpeg";
-    if (strcmp(ext, ".gif") == 0) return "image/gif";
-    if (strcmp(ext, ".png") == 0) return "image/png";
-    if (strcmp(ext, ".css") == 0) return "text/css";
-    if (strcmp(ext, ".au") == 0) return "audio/basic";
-    if (strcmp(ext, ".wav") == 0) return "audio/wav";
-    if (strcmp(ext, ".avi") == 0) return "video/x-msvideo";
-    if (strcmp(ext, ".mpeg") == 0 || strcmp(ext, ".mpg") == 0) return "video/mpeg";
-    if (strcmp(ext, ".mp3") == 0) return "audio/mpeg";
-    return NULL;
-}
+#define STATUS_LINE_SIZE 256
+#define ERROR_BODY_SIZE 512
+#define CONNECTION_CLOSE "Connection: close\r\n\r\n"
+#define HEADER_TIMEOUT_MS 10000     // to receive the request line
+#define SEND_TIMEOUT_MS 10000       // to send a response, plus the time it takes at MIN_SEND_RATE
+#define MIN_SEND_RATE 16384         // bytes per second
+#define ACCEPT_BATCH 32
+#define LISTING_CHUNK 512           // a listing gets one stat job per this many entries
+#define LISTING_MAX_JOBS 16
+#define HOT_PATHS_MAX 256
+#define HOT_PATH_LEN 256
+#define HANDOFF_ENV "WEBSERVER_HANDOFF_FD"
+#define HANDOFF_TIMEOUT_MS 10000   // for the new instance to take over on reload
+#define BUNDLE_ENV "WEBSERVER_BUNDLE"
+#define TRACE_ENV "WEBSERVER_TRACE"
+#define CONN_RATE_ENV "WEBSERVER_CONN_RATE"
+#define REQ_RATE_ENV "WEBSERVER_REQ_RATE"
+#define PREFIX_RATE_FACTOR 8        // a /24 or /64 gets this many times the limit of one address
+#define RATE_AGE_MS 10000           // how often idle rate limit buckets are freed
+
+// Set by SIGHUP/SIGUSR2 and SIGUSR1, checked by the accept loop in serve
+static volatile sig_atomic_t reload_requested = 0;
+static volatile sig_atomic_t dump_requested = 0;
+
+// Where SIGUSR1 dumps the trace, NULL unless WEBSERVER_TRACE is set
+static char* trace_file = NULL;
+
+// Path the server was started from, exec'ed on reload so a deployed binary takes over
+static char exe_path[PATH_MAX] = "";
+
+// Most requested paths, handed to the next instance on reload so it can warm up
+typedef struct hot_path_st {
+    char path[HOT_PATH_LEN];
+    unsigned long hits;
+} hot_path;
+
+static hot_path hot_paths[HOT_PATHS_MAX];
+static int hot_paths_count = 0;
+static pthread_mutex_t hot_paths_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Read and send deadlines of every connection
+static timerwheel* timers = NULL;
+
+// A connection handed from the accept loop to a worker
+typedef struct client_conn_st {
+    int socket;
+    tw_timer timer;
+    int shutdown_how;   //how the timer shuts the socket down when it expires
+    int timed_out;      //set by the timer, read after cancel_timer
+    unsigned long id;   //request id in the trace
+    unsigned long long queued;  //when it was dispatched, for the trace
+    struct sockaddr_storage peer;   //client address, for the request rate limit
+} client_conn;
+
+// Pool that stats the entries of big directory listings, NULL to list serially
+threadpool* listing_pool = NULL;
+
+// Packed docroot served before the filesystem, NULL unless WEBSERVER_BUNDLE is set
+static bundle* static_bundle = NULL;
+
+// Connection and request rate limits per address and per prefix, NULL when not set
+static ratelimiter* conn_limit_host = NULL;
+static ratelimiter* conn_limit_prefix = NULL;
+static ratelimiter* req_limit_host = NULL;
+static ratelimiter* req_limit_prefix = NULL;
+
+// Refused at accept time without reading the request, so it is sent as is
+static const char too_many_connections[] =
+    "HTTP/1.0 429 Too Many Requests\r\n"
+    "Server: webserver/1.0\r\n"
+    "Retry-After: 1\r\n"
+    "Content-Length: 0\r\n"
+    CONNECTION_CLOSE;
 
 char* getFullPath(const char* givenPath) {
     if (givenPath == NULL) {
@@ -102,51 +169,68 @@ char* read_request(int client_socket) {
     return first_line;
 }
 
-// Function to send an HTTP error response
-char* handle_error_response(int error_type, const char* path, const char* mime_type) {
-    now = time(NULL);
-    strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&now));
+// Function to start a response with the status line and the Server and Date headers
+response_t* start_response(int status, const char* status_message) {
+    response_t* response = create_response();
+    if (response == NULL) {
+        return NULL;
+    }
 
-    // Allocate memory for the final error message
-    char* error_message = (char*)malloc(RESPONSE_SIZE);
-    if (error_message == NULL) {
+    char date[128];
+    time_t t = time(NULL);
+    struct tm tm;
+    strftime(date, sizeof(date), RFC1123FMT, gmtime_r(&t, &tm));
+
+    char* status_line = (char*)malloc(STATUS_LINE_SIZE);
+    if (status_line == NULL) {
         perror("malloc");
+        destroy_response(response);
         return NULL;
     }
+    int len = snprintf(status_line, STATUS_LINE_SIZE,
+                       "HTTP/1.0 %d %s\r\n"
+                       "Server: webserver/1.0\r\n"
+                       "Date: %s\r\n",
+                       status, status_message, date);
+    add_buffer(response, status_line, len, 1);
+    return response;
+}
+
+// Function to add the entity headers and end the header block (Content-Type is left out if mime_type is NULL)
+int add_headers(response_t* response, const char* extra_headers, const char* mime_type, long long content_length) {
+    char content_type[128] = "";
+    if (mime_type != NULL) {
+        snprintf(content_type, sizeof(content_type), "Content-Type: %s\r\n", mime_type);
+    }
 
-    // Template for the HTTP response
-    const char *response_template =
-            "HTTP/1.0 %d %s\r\n"
-            "Server: webserver/1.0\r\n"
-            "Date: %s\r\n"
+    const char* headers_template =
             "%s" // Optional headers (e.g., Location for 302)
-            "Content-Type: %s\r\n"
-            "Content-Length: %zu\r\n"
-            "Connection: close\r\n"
-            "\r\n"
-            "<HTML><HEAD><TITLE>%d %s</TITLE></HEAD>\r\n"
-            "<BODY><H4>%d %s</H4>\r\n"
-            "%s\r\n"
-            "</BODY></HTML>\r\n";
+            "%s"
+            "Content-Length: %lld\r\n"
+            CONNECTION_CLOSE;
+    int len = snprintf(NULL, 0, headers_template, extra_headers, content_type, content_length);
+    char* headers = (char*)malloc(len + 1);
+    if (headers == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    snprintf(headers, len + 1, headers_template, extra_headers, content_type, content_length);
+    return add_buffer(response, headers, len, 1);
+}
 
+// Function to send an HTTP error response
+response_t* handle_error_response(int error_type, const char* path, const char* mime_type) {
     // Define error details
     const char *status_message = NULL;
     const char *body_content = NULL;
-    char *optional_headers = "";
+    char optional_headers[PATH_MAX + 16] = "";
 
     switch (error_type) {
         case 302: // 302 Found (Directory does not end with '/')
             status_message = "Found";
             body_content = "Directories must end with a slash.";
             mime_type = "text/html";
-            optional_headers = (char*)malloc(256); // Allocate memory for Location header
-            if (optional_headers == NULL) {
-                perror("malloc");
-                //fprintf(stderr,"Freeing pointer: error massage\n");
-                free(error_message);
-                return NULL;
-            }
-            snprintf(optional_headers, 256, "Location: %s/\r\n", path);
+            snprintf(optional_headers, sizeof(optional_headers), "Location: %s/\r\n", path);
             break;
 
         case 400: // 400 Bad Request
@@ -167,6 +251,19 @@ char* handle_error_response(int error_type, const char* path, const char* mime_t
             mime_type = "text/html";
             break;
 
+        case 408: // 408 Request Timeout
+            status_message = "Request Timeout";
+            body_content = "Timed out waiting for the request.";
+            mime_type = "text/html";
+            break;
+
+        case 429: // 429 Too Many Requests
+            status_message = "Too Many Requests";
+            body_content = "Too many requests, slow down.";
+            mime_type = "text/html";
+            snprintf(optional_headers, sizeof(optional_headers), "Retry-After: 1\r\n");
+            break;
+
         case 500: // 500 Internal Server Error
             status_message = "Internal Server Error";
             body_content = "Some server side error.";
@@ -186,34 +283,34 @@ char* handle_error_response(int error_type, const char* path, const char* mime_t
             break;
     }
 
-    // Calculate the content length (only the HTML body)
+    // The HTML body goes out as its own segment after the headers
     const char* html_template =
             "<HTML><HEAD><TITLE>%d %s</TITLE></HEAD>\r\n"
             "<BODY><H4>%d %s</H4>\r\n"
             "%s\r\n"
             "</BODY></HTML>\r\n";
 
-    char html_body[512];
-    snprintf(html_body, sizeof(html_body), html_template,
+    char* html_body = (char*)malloc(ERROR_BODY_SIZE);
+    if (html_body == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+    snprintf(html_body, ERROR_BODY_SIZE, html_template,
              error_type, status_message, error_type, status_message, body_content);
-
     size_t content_length = strlen(html_body);
 
-    // Format the final response
-    snprintf(error_message, RESPONSE_SIZE, response_template,
-             error_type, status_message, timebuf, optional_headers,mime_type, content_length,
-             error_type, status_message, error_type, status_message, body_content);
-
-    if (strcmp(optional_headers,"") != 0) {
-        //fprintf(stderr,"Freeing pointer: optional headers\n");
-        free(optional_headers);
+    response_t* response = start_response(error_type, status_message);
+    if (response == NULL || add_headers(response, optional_headers, mime_type, content_length) < 0) {
+        free(html_body);
+        destroy_response(response);
+        return NULL;
     }
-    //fprintf(stderr,"full message: %s\n",error_message);
-    return error_message;
+    add_buffer(response, html_body, content_length, 1);
+    return response;
 }
 
 // Function to check if the requested path exists
-char* check_path(const char* path) {
+response_t* check_path(const char* path) {
     // Open the current directory
     char* mime_type = get_mime_type((char*)path);
     DIR* dir = opendir(".");
@@ -240,143 +337,252 @@ char* check_path(const char* path) {
     return NULL; // No error
 }
 
-// Function to generate directory listing in HTML format
-char* generate_directory_listing(const char* path) {
+// One row of a directory listing
+typedef struct listing_entry_st {
+    char* name;
+    struct stat st;
+    int ok;             //0 if stat failed, the entry is left out
+} listing_entry;
+
+// The entries one stat job works on
+typedef struct listing_chunk_st {
+    int dir_fd;
+    listing_entry* entries;
+    int count;
+} listing_chunk;
+
+// Column (N, M or S) and direction a listing is sorted by
+typedef struct listing_order_st {
+    char column;
+    int descending;
+} listing_order;
+
+// Growable HTML body
+typedef struct html_buf_st {
+    char* data;
+    size_t len;
+    size_t cap;
+} html_buf;
+
+// Job of a listing: stat a chunk of entries relative to the directory
+int stat_entries(void* arg) {
+    listing_chunk* chunk = (listing_chunk*)arg;
+    for (int i = 0; i < chunk->count; i++) {
+        listing_entry* e = &chunk->entries[i];
+        e->ok = fstatat(chunk->dir_fd, e->name, &e->st, 0) == 0;
+    }
+    return 0;
+}
+
+// Function to read the sort order from a "C=N|M|S;O=A|D" query string, by name ascending if absent
+listing_order parse_listing_order(const char* query) {
+    listing_order order = { 'N', 0 };
+    for (const char* p = query; p != NULL && *p != '\0'; p++) {
+        if ((p == query || p[-1] == ';' || p[-1] == '&') && p[1] == '=') {
+            if (p[0] == 'C' && (p[2] == 'N' || p[2] == 'M' || p[2] == 'S')) {
+                order.column = p[2];
+            } else if (p[0] == 'O' && (p[2] == 'A' || p[2] == 'D')) {
+                order.descending = p[2] == 'D';
+            }
+        }
+    }
+    return order;
+}
+
+int compare_entries(const void* a, const void* b, void* arg) {
+    const listing_entry* x = (const listing_entry*)a;
+    const listing_entry* y = (const listing_entry*)b;
+    const listing_order* order = (const listing_order*)arg;
+    int cmp = 0;
+    if (order->column == 'M') {
+        cmp = (x->st.st_mtime > y->st.st_mtime) - (x->st.st_mtime < y->st.st_mtime);
+    } else if (order->column == 'S') {
+        cmp = (x->st.st_size > y->st.st_size) - (x->st.st_size < y->st.st_size);
+    }
+    if (cmp == 0) {
+        cmp = strcmp(x->name, y->name); // Ties in name order
+    }
+    return order->descending ? -cmp : cmp;
+}
+
+int append_html(html_buf* b, const char* s, size_t n) {
+    if (b->len + n + 1 > b->cap) {
+        size_t cap = b->cap * 2 > b->len + n + 1 ? b->cap * 2 : b->len + n + 1;
+        char* data = (char*)realloc(b->data, cap);
+        if (data == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+    b->data[b->len] = '\0';
+    return 0;
+}
+
+// Function to stat every entry, split in chunks over listing_pool when there are many
+void stat_listing(int dir_fd, listing_entry* entries, int count) {
+    int jobs = count / LISTING_CHUNK;
+    if (jobs > LISTING_MAX_JOBS) jobs = LISTING_MAX_JOBS;
+    if (listing_pool == NULL || jobs < 2) {
+        listing_chunk all = { dir_fd, entries, count };
+        stat_entries(&all);
+        return;
+    }
+
+    listing_chunk chunks[LISTING_MAX_JOBS];
+    future_t* futures[LISTING_MAX_JOBS];
+    int submitted = 0;
+    for (int i = 0; i < jobs; i++) {
+        int begin = (int)((long)count * i / jobs);
+        int end = (int)((long)count * (i + 1) / jobs);
+        chunks[i] = (listing_chunk){ dir_fd, entries + begin, end - begin };
+        futures[submitted] = submit(listing_pool, stat_entries, &chunks[i]);
+        if (futures[submitted] == NULL) {
+            stat_entries(&chunks[i]);
+        } else {
+            submitted++;
+        }
+    }
+
+    // Chunks no worker picked up yet are stat'ed here, then wait for the rest
+    future_wait_all(futures, submitted);
+    for (int i = 0; i < submitted; i++) {
+        destroy_future(futures[i]);
+    }
+}
+
+// Function to generate directory listing in HTML format, sorted as the query string asks
+char* generate_directory_listing(const char* path, const char* query) {
     DIR* dir = opendir(path);
     if (dir == NULL) {
         perror("opendir");
         return NULL;
     }
 
-    // Preallocate a buffer for the entire directory listing
-    char* html_body = (char*)malloc(RESPONSE_SIZE);
-    if (html_body == NULL) {
+    // Read every name first so the stats can be spread over the pool
+    int count = 0, capacity = 64;
+    listing_entry* entries = (listing_entry*)malloc(capacity * sizeof(listing_entry));
+    if (entries == NULL) {
         perror("malloc");
         closedir(dir);
         return NULL;
     }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (count == capacity) {
+            listing_entry* grown = (listing_entry*)realloc(entries, 2 * capacity * sizeof(listing_entry));
+            if (grown == NULL) {
+                perror("realloc");
+                break; // List what was read
+            }
+            entries = grown;
+            capacity *= 2;
+        }
+        entries[count].name = strdup(entry->d_name);
+        if (entries[count].name != NULL) {
+            count++;
+        }
+    }
+
+    stat_listing(dirfd(dir), entries, count);
+    closedir(dir);
+
+    listing_order order = parse_listing_order(query);
+    qsort_r(entries, count, sizeof(listing_entry), compare_entries, &order);
 
-    // HTML header
-    snprintf(html_body, RESPONSE_SIZE,
+    // The header links sort by their column, a second click reverses the order
+    html_buf body = { NULL, 0, 0 };
+    char line[1024 + 2 * NAME_MAX];
+    const char* columns = "NMS";
+    char order_by[3];
+    for (int i = 0; i < 3; i++) {
+        order_by[i] = columns[i] == order.column && !order.descending ? 'D' : 'A';
+    }
+    int n = snprintf(line, sizeof(line),
              "<HTML>\n"
              "<HEAD><TITLE>Index of %s</TITLE></HEAD>\n"
              "<BODY>\n"
              "<H4>Index of %s</H4>\n"
              "<table CELLSPACING=8>\n"
-             "<tr><th>Name</th><th>Last Modified</th><th>Size</th></tr>\n",
-             path, path);
-
-    // Iterate through directory entries
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != NULL) {
-        char full_path[PATH_MAX];
-        snprintf(full_path, sizeof(full_path), "%s/%s", path, entry->d_name);
-
-        struct stat entry_stat;
-        if (stat(full_path, &entry_stat) != 0) {
-            continue; // Skip if stat fails
+             "<tr><th><A HREF=\"?C=N;O=%c\">Name</A></th>"
+             "<th><A HREF=\"?C=M;O=%c\">Last Modified</A></th>"
+             "<th><A HREF=\"?C=S;O=%c\">Size</A></th></tr>\n",
+             path, path, order_by[0], order_by[1], order_by[2]);
+    int failed = append_html(&body, line, n < (int)sizeof(line) ? n : (int)sizeof(line) - 1);
+
+    for (int i = 0; i < count; i++) {
+        listing_entry* e = &entries[i];
+        if (!e->ok || failed) {
+            free(e->name);
+            continue; // Skip if stat failed
         }
 
         // Add entry to the HTML table
-        strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&entry_stat.st_mtime));
-
-        char entity_line[1024]; // Buffer for each entity line
-        if (S_ISDIR(entry_stat.st_mode)) {
+        char mtime[128];
+        struct tm tm;
+        strftime(mtime, sizeof(mtime), RFC1123FMT, gmtime_r(&e->st.st_mtime, &tm));
+        if (S_ISDIR(e->st.st_mode)) {
             // Directory entry
-            snprintf(entity_line, sizeof(entity_line),
-                     "<tr><td><A HREF=\"%s/\">%s/</A></td><td>%s</td><td></td></tr>\n",
-                     entry->d_name, entry->d_name, timebuf);
+            n = snprintf(line, sizeof(line),
+                         "<tr><td><A HREF=\"%s/\">%s/</A></td><td>%s</td><td></td></tr>\n",
+                         e->name, e->name, mtime);
         } else {
             // File entry
-            snprintf(entity_line, sizeof(entity_line),
-                     "<tr><td><A HREF=\"%s\">%s</A></td><td>%s</td><td>%ld</td></tr>\n",
-                     entry->d_name, entry->d_name, timebuf, entry_stat.st_size);
+            n = snprintf(line, sizeof(line),
+                         "<tr><td><A HREF=\"%s\">%s</A></td><td>%s</td><td>%ld</td></tr>\n",
+                         e->name, e->name, mtime, e->st.st_size);
         }
-
-        // Append the entity line to the HTML body
-        strncat(html_body, entity_line, RESPONSE_SIZE - strlen(html_body) - 1);
+        failed = append_html(&body, line, n < (int)sizeof(line) ? n : (int)sizeof(line) - 1);
+        free(e->name);
     }
+    free(entries);
 
     // Close the HTML response
-    strncat(html_body,
+    static const char footer[] =
             "</table>\n"
             "<HR>\n"
             "<ADDRESS>webserver/1.0</ADDRESS>\n"
-            "</BODY></HTML>\n",
-            RESPONSE_SIZE - strlen(html_body) - 1);
-
-    closedir(dir);
-    return html_body;
+            "</BODY></HTML>\n";
+    if (failed || append_html(&body, footer, sizeof(footer) - 1) < 0) {
+        free(body.data);
+        return NULL;
+    }
+    return body.data;
 }
 
 // Function to handle file responses
-char* handle_file_response(const char* path) {
-    FILE* file = fopen(path, "rb");
-    if (file == NULL) {
+response_t* handle_file_response(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
         return NULL; // File cannot be opened
     }
 
     // Get file size
-    fseek(file, 0, SEEK_END);
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-
-    // Allocate memory for the file data
-    char* file_data = malloc(file_size + 1);
-    if (file_data == NULL) {
-        fclose(file);
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0) {
+        close(fd);
         return NULL;
     }
 
-    // Read file data
-    fread(file_data, 1, file_size, file);
-    file_data[file_size] = '\0';
-    fclose(file);
-
-    // Generate the HTTP response
-    char* response = malloc(RESPONSE_SIZE);
-    if (response == NULL) {
-        free(file_data);
+    // Get MIME type, Content-Type is left out if it is unknown
+    char* mime_type = get_mime_type((char*)path);
+    response_t* response = start_response(200, "OK");
+    if (response == NULL || add_headers(response, "", mime_type, file_stat.st_size) < 0) {
+        destroy_response(response);
+        close(fd);
         return NULL;
     }
 
-    // Get MIME type
-    char* mime_type = get_mime_type((char*)path);
-    now = time(NULL);
-    strftime(timebuf, sizeof(timebuf), RFC1123FMT, gmtime(&now));
-
-
-    // Format the HTTP response
-    if (mime_type != NULL) {
-        // Include Content-Type header if mime_type is not NULL
-        snprintf(response, RESPONSE_SIZE,
-                 "HTTP/1.0 200 OK\r\n"
-                 "Server: webserver/1.0\r\n"
-                 "Date: %s\r\n"
-                 "Content-Type: %s\r\n"
-                 "Content-Length: %ld\r\n"
-                 "Connection: close\r\n"
-                 "\r\n"
-                 "%s",
-                 timebuf, mime_type, file_size, file_data);
-    } else {
-        // Exclude Content-Type header if mime_type is NULL
-        snprintf(response, RESPONSE_SIZE,
-                 "HTTP/1.0 200 OK\r\n"
-                 "Server: webserver/1.0\r\n"
-                 "Date: %s\r\n"
-                 "Content-Length: %ld\r\n"
-                 "Connection: close\r\n"
-                 "\r\n"
-                 "%s",
-                 timebuf, file_size, file_data);
-    }
-    free(file_data);
+    // The body is sent straight from the file
+    add_file(response, fd, 0, file_stat.st_size, 1);
     return response;
 }
 
 // Function to handle OK responses
-char* handle_ok_response(const char* path) {
+response_t* handle_ok_response(const char* path, const char* query) {
     char* mime_type = get_mime_type((char*) path);
     struct stat path_stat;
     if (stat(path, &path_stat) != 0) {
@@ -399,32 +605,20 @@ char* handle_ok_response(const char* path) {
             return handle_file_response(index_path);
         } else {
             // No index.html, generate directory listing
-            char* html_body = generate_directory_listing(path);
+            char* html_body = generate_directory_listing(path, query);
             if (html_body == NULL) {
                 return NULL; // Failed to generate directory listing
             }
 
-            // Generate the 200 OK response with the directory listing
-            char* response = (char*)malloc(RESPONSE_SIZE);
-            if (response == NULL) {
-               // fprintf(stderr,"Freeing pointer: html body\n");
+            // Generate the 200 OK response, the listing is its body segment
+            size_t body_len = strlen(html_body);
+            response_t* response = start_response(200, "OK");
+            if (response == NULL || add_headers(response, "", "text/html", body_len) < 0) {
                 free(html_body);
+                destroy_response(response);
                 return NULL;
             }
-
-            // Format the HTTP response
-            snprintf(response, RESPONSE_SIZE,
-                     "HTTP/1.0 200 OK\r\n"
-                     "Server: webserver/1.0\r\n"
-                     "Date: %s\r\n"
-                     "Content-Type: text/html\r\n"
-                     "Content-Length: %zu\r\n"
-                     "Connection: close\r\n"
-                     "\r\n"
-                     "%s",
-                     timebuf, strlen(html_body), html_body);
-            //fprintf(stderr,"Freeing pointer: html body\n");
-            free(html_body);
+            add_buffer(response, html_body, body_len, 1);
             return response;
         }
     } else if (S_ISREG(path_stat.st_mode)) {
@@ -442,20 +636,124 @@ char* handle_ok_response(const char* path) {
     }
 }
 
+// Function to count a request for a path, skipped when another thread holds the lock
+void record_hot_path(const char* path, unsigned long hits) {
+    if (strlen(path) >= HOT_PATH_LEN) {
+        return;
+    }
+    if (pthread_mutex_trylock(&hot_paths_lock) != 0) {
+        return; // Sampling is good enough, never stall a worker on this
+    }
+
+    int slot = 0;
+    for (int i = 0; i < hot_paths_count; i++) {
+        if (strcmp(hot_paths[i].path, path) == 0) {
+            hot_paths[i].hits += hits;
+            pthread_mutex_unlock(&hot_paths_lock);
+            return;
+        }
+        if (hot_paths[i].hits < hot_paths[slot].hits) {
+            slot = i;
+        }
+    }
+
+    if (hot_paths_count < HOT_PATHS_MAX) {
+        slot = hot_paths_count++;
+        hot_paths[slot].hits = 0;
+    }
+    // A full table replaces its coldest entry, which keeps its count (space-saving)
+    snprintf(hot_paths[slot].path, HOT_PATH_LEN, "%s", path);
+    hot_paths[slot].hits += hits;
+    pthread_mutex_unlock(&hot_paths_lock);
+}
+
+static int compare_hot_paths(const void* a, const void* b) {
+    const hot_path* x = (const hot_path*)a;
+    const hot_path* y = (const hot_path*)b;
+    if (x->hits == y->hits) return 0;
+    return x->hits > y->hits ? -1 : 1;
+}
+
+// Function to serialize the hot path list as "<hits> <path>\n" lines, hottest first
+char* snapshot_hot_paths(size_t* len) {
+    hot_path* copy = (hot_path*)malloc(sizeof(hot_paths));
+    char* snapshot = (char*)malloc(HOT_PATHS_MAX * (HOT_PATH_LEN + 32) + 1);
+    if (copy == NULL || snapshot == NULL) {
+        perror("malloc");
+        free(copy);
+        free(snapshot);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&hot_paths_lock);
+    int count = hot_paths_count;
+    memcpy(copy, hot_paths, count * sizeof(hot_path));
+    pthread_mutex_unlock(&hot_paths_lock);
+
+    qsort(copy, count, sizeof(hot_path), compare_hot_paths);
+    *len = 0;
+    snapshot[0] = '\0';
+    for (int i = 0; i < count; i++) {
+        *len += sprintf(snapshot + *len, "%lu %s\n", copy[i].hits, copy[i].path);
+    }
+    free(copy);
+    return snapshot;
+}
+
+// Function to seed the hot path list from a snapshot and pull those files into the kernel caches
+void warm_hot_paths(char* snapshot) {
+    char* save = NULL;
+    int warmed = 0;
+    for (char* line = strtok_r(snapshot, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+        unsigned long hits;
+        char path[HOT_PATH_LEN];
+        if (sscanf(line, "%lu %255s", &hits, path) != 2) {
+            continue;
+        }
+        record_hot_path(path, hits);
+
+        char* full_path = getFullPath(path);
+        if (full_path == NULL) {
+            continue;
+        }
+        struct stat path_stat;
+        if (stat(full_path, &path_stat) == 0 && S_ISREG(path_stat.st_mode)) {
+            int fd = open(full_path, O_RDONLY | O_CLOEXEC);
+            if (fd >= 0) {
+                posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+                close(fd);
+            }
+        }
+        free(full_path);
+        warmed++;
+    }
+    printf("Warmed %d hot paths\n", warmed);
+}
+
 // Function to check the first line of the HTTP request
-char* request_handler(const char* request) {
+response_t* request_handler(const char* request) {
     char method[32] = {0}, path[256] = {0}, protocol[32] = {0};
 
     // Parse the first line of the request
+    unsigned long long stage_start;
+    TRACE_BEGIN("parse", stage_start);
     int tokens = sscanf(request, "%31s %255s %31s", method, path, protocol);
 
     // Invalid number of tokens
     if (tokens != 3) {
+        TRACE_END("parse", stage_start);
         return handle_error_response(400, NULL, NULL);
     }
 
+    // The query string only picks the order of a directory listing
+    char* query = strchr(path, '?');
+    if (query != NULL) {
+        *query++ = '\0';
+    }
+
     char* final_path = getFullPath(path);
     char* mime_type = get_mime_type(final_path);
+    TRACE_END("parse", stage_start);
 
     // Validate the protocol
     if (strcmp(protocol, "HTTP/1.0") != 0 && strcmp(protocol, "HTTP/1.1") != 0) {
@@ -470,15 +768,20 @@ char* request_handler(const char* request) {
     }
 
     // Check if the path exists
-    char* error_response = check_path(final_path);
+    TRACE_BEGIN("check_path", stage_start);
+    response_t* error_response = check_path(final_path);
+    TRACE_END("check_path", stage_start);
     if (error_response != NULL) {
         free(final_path); // Free final_path before returning
         return error_response;
     }
 
     // Path is valid, handle the OK response
-    char* ok_response = handle_ok_response(final_path);
+    TRACE_BEGIN("handle_ok_response", stage_start);
+    response_t* ok_response = handle_ok_response(final_path, query);
+    TRACE_END("handle_ok_response", stage_start);
     if (ok_response != NULL) {
+        record_hot_path(path, 1);
         free(final_path); // Free final_path before returning
         return ok_response;
     }
@@ -488,34 +791,566 @@ char* request_handler(const char* request) {
     return handle_error_response(500, NULL, mime_type);
 }
 
+// Function to check whether the headers read so far accept a gzip body (listed with q > 0)
+bool accepts_gzip(const char* request) {
+    const char* field = strcasestr(request, "\r\nAccept-Encoding:");
+    if (field == NULL) {
+        return false;
+    }
+    const char* p = field + strlen("\r\nAccept-Encoding:");
+    const char* end = strstr(p, "\r\n");
+    if (end == NULL) {
+        // read_request stopped inside the field, a "q=0" may be missing: serve identity
+        return false;
+    }
+
+    // Codings are "name[;q=weight]" separated by commas, "*" stands for any coding not listed
+    double gzip_q = -1, any_q = -1;
+    while (p < end) {
+        const char* next = memchr(p, ',', end - p);
+        if (next == NULL) {
+            next = end;
+        }
+        while (p < next && (*p == ' ' || *p == '\t')) p++;
+        size_t name_len = 0;
+        while (p + name_len < next && p[name_len] != ';' && p[name_len] != ' ' && p[name_len] != '\t') {
+            name_len++;
+        }
+
+        double q = 1;
+        for (const char* param = memchr(p, ';', next - p); param != NULL;
+             param = memchr(param + 1, ';', next - param - 1)) {
+            const char* v = param + 1;
+            while (v < next && (*v == ' ' || *v == '\t')) v++;
+            if (v + 1 < next && (*v == 'q' || *v == 'Q') && v[1] == '=') {
+                q = strtod(v + 2, NULL);
+            }
+        }
+
+        // x-gzip is the old name of gzip
+        if ((name_len == 4 && strncasecmp(p, "gzip", 4) == 0) ||
+            (name_len == 6 && strncasecmp(p, "x-gzip", 6) == 0)) {
+            gzip_q = q;
+        } else if (name_len == 1 && *p == '*') {
+            any_q = q;
+        }
+        p = next + 1;
+    }
+    return gzip_q >= 0 ? gzip_q > 0 : any_q > 0;
+}
+
+// Function to build the response for a bundled path, returns NULL if the path is not bundled
+response_t* bundle_response(const char* request) {
+    char method[32] = {0}, path[256] = {0}, protocol[32] = {0};
+    if (static_bundle == NULL ||
+        sscanf(request, "%31s %255s %31s", method, path, protocol) != 3 ||
+        strcmp(method, "GET") != 0 ||
+        (strcmp(protocol, "HTTP/1.0") != 0 && strcmp(protocol, "HTTP/1.1") != 0)) {
+        return NULL; // Not in the bundle, request_handler takes it
+    }
+
+    const bundle_entry* entry = find_in_bundle(static_bundle, path, strcspn(path, "?"));
+    if (entry == NULL) {
+        return NULL;
+    }
+
+    const char* headers = static_bundle->strings + entry->headers_off;
+    size_t headers_len = entry->headers_len;
+    const char* body = (const char*)static_bundle->map + entry->body_off;
+    size_t body_len = entry->body_len;
+    if (entry->gz_body_len > 0 && accepts_gzip(request)) {
+        headers = static_bundle->strings + entry->gz_headers_off;
+        headers_len = entry->gz_headers_len;
+        body = (const char*)static_bundle->map + entry->gz_body_off;
+        body_len = entry->gz_body_len;
+    }
+
+    // Precomputed headers and the body are sent from the mapping, nothing is copied
+    response_t* response = start_response(200, "OK");
+    if (response == NULL) {
+        return NULL;
+    }
+    add_buffer(response, headers, headers_len, 0);
+    add_buffer(response, CONNECTION_CLOSE, strlen(CONNECTION_CLOSE), 0);
+    add_buffer(response, body, body_len, 0);
+    return response;
+}
+
+// Function to check a client against the limits of its address and of its /24 (/64 for IPv6)
+int allow_client(ratelimiter* host, ratelimiter* prefix, const struct sockaddr_storage* peer) {
+    if (host == NULL) {
+        return 1;
+    }
+    // The prefix is only charged for what the address itself was allowed
+    return rate_limit_allow(host, client_key(peer, 32, 128)) &&
+           rate_limit_allow(prefix, client_key(peer, 24, 64));
+}
+
+// Timer callback: unblock the worker stuck on this connection (runs under the wheel lock)
+void expire_connection(void* arg) {
+    client_conn* conn = (client_conn*)arg;
+    conn->timed_out = 1;
+    shutdown(conn->socket, conn->shutdown_how);
+}
+
+// Function to send a response under a deadline that grows with its size.
+// When it expires, the shutdown makes the blocked sendmsg/sendfile fail with
+// EPIPE; SIGPIPE is ignored (see main), so only this connection ends
+void send_with_timeout(client_conn* conn, response_t* response) {
+    conn->shutdown_how = SHUT_RDWR;
+    unsigned long timeout = SEND_TIMEOUT_MS + response_length(response) / MIN_SEND_RATE * 1000;
+    add_timer(timers, &conn->timer, timeout, expire_connection, conn);
+    send_response(response, conn->socket);
+    cancel_timer(timers, &conn->timer);
+}
+
 // Function to handle client requests
 int handle_client(void* arg) {
-    int client_socket = *((int*)arg);
+    client_conn* conn = (client_conn*)arg;
+    int client_socket = conn->socket;
+    unsigned long long stage_start;
+    trace_request(conn->id);
+    TRACE_WAIT_END("queue", conn->queued);
+
+    // The whole request line has to arrive before the deadline, slow senders included
+    conn->timed_out = 0;
+    conn->shutdown_how = SHUT_RD;
+    TRACE_BEGIN("read", stage_start);
+    add_timer(timers, &conn->timer, HEADER_TIMEOUT_MS, expire_connection, conn);
     char* request = read_request(client_socket);
-    // Handle the request using the request_handler function
-    char* response = request_handler(request);
-
-    if (request == NULL) {
+    cancel_timer(timers, &conn->timer);
+    TRACE_END("read", stage_start);
+
+    if (request == NULL || conn->timed_out) {
+        if (conn->timed_out) {
+            response_t* response = handle_error_response(408, NULL, NULL);
+            if (response != NULL) {
+                send_with_timeout(conn, response);
+                destroy_response(response);
+            }
+        }
         close(client_socket);
-        free(response);
+        free(request);
+        free(conn);
         return -1;
     }
 
+    // Over its request rate the client gets a 429 before any lookup, else
+    // bundled paths first, then the filesystem through request_handler
+    response_t* response = NULL;
+    if (!allow_client(req_limit_host, req_limit_prefix, &conn->peer)) {
+        response = handle_error_response(429, NULL, NULL);
+    } else {
+        TRACE_BEGIN("bundle", stage_start);
+        response = bundle_response(request);
+        TRACE_END("bundle", stage_start);
+        if (response == NULL) {
+            response = request_handler(request);
+        }
+    }
+
     // Send the response to the client
     if (response != NULL) {
-        ssize_t bytes_sent = write(client_socket, response, strlen(response));
-        if (bytes_sent < 0) {
-            perror("write");
-        }
-        free(response);
+        TRACE_BEGIN("write", stage_start);
+        send_with_timeout(conn, response);
+        TRACE_END("write", stage_start);
+        destroy_response(response);
     }
 
     // Clean up
     close(client_socket);
     free(request);
+    free(conn);
+    return 0;
+}
+
+void handle_control_signal(int sig) {
+    if (sig == SIGUSR1) {
+        dump_requested = 1;
+    } else {
+        reload_requested = 1;
+    }
+}
+
+// Function to write the trace collected so far, if tracing is on
+void write_trace(void) {
+    if (trace_file == NULL) {
+        return;
+    }
+    int spans = dump_trace(trace_file);
+    if (spans >= 0) {
+        printf("Wrote %d trace spans to %s\n", spans, trace_file);
+    }
+}
+
+// Function to start a new instance of the server and pass it the listening socket.
+// Returns the channel the new instance answers on when it is ready (see finish_handoff), or -1.
+int handoff_listen_socket(int server_socket, char* argv[], pid_t* new_pid) {
+    int chan[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, chan) < 0) {
+        perror("socketpair");
+        return -1;
+    }
+
+    // Prepare the environment before fork, the child should only exec
+    char fd_env[16];
+    snprintf(fd_env, sizeof(fd_env), "%d", chan[1]);
+    setenv(HANDOFF_ENV, fd_env, 1);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(chan[0]);
+        fcntl(chan[1], F_SETFD, 0); // Keep our end of the channel across exec
+        if (exe_path[0] != '\0') {
+            execv(exe_path, argv);
+        }
+        execv("/proc/self/exe", argv);
+        perror("exec");
+        _exit(1);
+    }
+    unsetenv(HANDOFF_ENV);
+    close(chan[1]);
+    if (pid < 0) {
+        perror("fork");
+        close(chan[0]);
+        return -1;
+    }
+
+    // Send the listening socket, then the hot path snapshot
+    char tag = 'L';
+    struct iovec iov = { .iov_base = &tag, .iov_len = 1 };
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &server_socket, sizeof(int));
+    if (sendmsg(chan[0], &msg, MSG_NOSIGNAL) < 0) {
+        perror("sendmsg");
+        close(chan[0]);
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+
+    size_t len = 0;
+    char* snapshot = snapshot_hot_paths(&len);
+    size_t sent = 0;
+    while (snapshot != NULL && sent < len) {
+        ssize_t n = send(chan[0], snapshot + sent, len - sent, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("send");
+            break;
+        }
+        sent += n;
+    }
+    free(snapshot);
+    shutdown(chan[0], SHUT_WR);
+
+    // serve keeps accepting until the new instance answers on chan[0]
+    *new_pid = pid;
+    return chan[0];
+}
+
+// Function to wait up to "timeout_ms" for the new instance to be ready, returns 0 if it took over
+int finish_handoff(int chan, pid_t pid, int timeout_ms) {
+    struct pollfd pfd = { .fd = chan, .events = POLLIN };
+    int ready;
+    do {
+        ready = poll(&pfd, 1, timeout_ms);
+    } while (ready < 0 && errno == EINTR);
+
+    char ack = 0;
+    ssize_t n = -1;
+    if (ready > 0) {
+        n = read(chan, &ack, 1);
+    }
+    close(chan);
+    if (n != 1 || ack != 'R') {
+        // A late instance must not start accepting next to this one
+        printf("Reload failed, new instance did not take over\n");
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    printf("Handed listening socket to new instance (pid %d)\n", pid);
+    return 0;
+}
+
+// Function to find the server binary from argv[0], made absolute but with symlinks kept
+void resolve_executable(const char* argv0) {
+    char found[PATH_MAX] = "";
+    if (strchr(argv0, '/') != NULL) {
+        snprintf(found, sizeof(found), "%s", argv0);
+    } else {
+        // Started through PATH, an empty entry is the working directory
+        const char* dirs = getenv("PATH");
+        while (dirs != NULL && *dirs != '\0' && found[0] == '\0') {
+            size_t len = strcspn(dirs, ":");
+            char candidate[PATH_MAX];
+            snprintf(candidate, sizeof(candidate), "%.*s/%s", (int)(len > 0 ? len : 1), len > 0 ? dirs : ".", argv0);
+            if (access(candidate, X_OK) == 0) {
+                snprintf(found, sizeof(found), "%s", candidate);
+            }
+            dirs += len;
+            if (*dirs == ':') dirs++;
+        }
+    }
+    if (found[0] == '\0') {
+        return; // Reload falls back to /proc/self/exe
+    }
+
+    char cwd[PATH_MAX];
+    if (found[0] == '/') {
+        snprintf(exe_path, sizeof(exe_path), "%s", found);
+    } else if (getcwd(cwd, sizeof(cwd)) != NULL &&
+               snprintf(exe_path, sizeof(exe_path), "%s/%s", cwd, found) >= (int)sizeof(exe_path)) {
+        exe_path[0] = '\0'; // Too long, fall back
+    }
+}
+
+// Function to take over the listening socket from the previous instance, returns the socket or -1
+int receive_listen_socket(int chan) {
+    char tag;
+    struct iovec iov = { .iov_base = &tag, .iov_len = 1 };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(chan, &msg, MSG_CMSG_CLOEXEC) != 1) {
+        perror("recvmsg");
+        close(chan);
+        return -1;
+    }
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        printf("Handoff message carried no socket\n");
+        close(chan);
+        return -1;
+    }
+    int server_socket;
+    memcpy(&server_socket, CMSG_DATA(cmsg), sizeof(int));
+
+    // Read the hot path snapshot until the old instance closes its side
+    size_t cap = BUFFER_SIZE, len = 0;
+    char* snapshot = (char*)malloc(cap);
+    while (snapshot != NULL) {
+        if (len == cap - 1) {
+            char* bigger = (char*)realloc(snapshot, cap * 2);
+            if (bigger == NULL) break;
+            snapshot = bigger;
+            cap *= 2;
+        }
+        ssize_t n = read(chan, snapshot + len, cap - 1 - len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len += n;
+    }
+    if (snapshot != NULL) {
+        snapshot[len] = '\0';
+        warm_hot_paths(snapshot);
+        free(snapshot);
+    }
+
+    // Tell the old instance to stop accepting
+    char ack = 'R';
+    if (write(chan, &ack, 1) != 1) {
+        perror("write");
+    }
+    close(chan);
+    return server_socket;
+}
+
+// Function to free the idle buckets of every rate limit
+void age_rate_limits(void) {
+    ratelimiter* limits[] = { conn_limit_host, conn_limit_prefix, req_limit_host, req_limit_prefix };
+    for (int i = 0; i < 4; i++) {
+        if (limits[i] != NULL) {
+            age_ratelimiter(limits[i]);
+        }
+    }
+}
+
+// Function to create the address and prefix limits from a "rate[/burst]" setting
+int create_rate_limits(const char* setting, ratelimiter** host, ratelimiter** prefix) {
+    unsigned int rate = 0, burst = 0;
+    int n = sscanf(setting, "%u/%u", &rate, &burst);
+    if (n < 1) {
+        fprintf(stderr, "Invalid rate limit \"%s\", expected rate[/burst]\n", setting);
+        return -1;
+    }
+    if (n == 1) {
+        burst = rate;
+    }
+
+    // Checked here so the prefix limit, PREFIX_RATE_FACTOR times larger, cannot overflow
+    unsigned int max = RL_MAX_LIMIT / PREFIX_RATE_FACTOR;
+    if (rate == 0 || burst == 0 || rate > max || burst > max) {
+        fprintf(stderr, "Invalid rate limit \"%s\", rate and burst must be between 1 and %u\n",
+                setting, max);
+        return -1;
+    }
+    *host = create_ratelimiter(rate, burst);
+    *prefix = create_ratelimiter(rate * PREFIX_RATE_FACTOR, burst * PREFIX_RATE_FACTOR);
+    if (*host == NULL || *prefix == NULL) {
+        destroy_ratelimiter(*host);
+        destroy_ratelimiter(*prefix);
+        *host = *prefix = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Function to run the accept loop until max_requests or a reload, then drain the pool
+int serve(int server_socket, threadpool* tp, int max_requests, char* argv[]) {
+    // Accept without blocking so the backlog can be drained in one go
+    int flags = fcntl(server_socket, F_GETFL);
+    if (flags < 0 || fcntl(server_socket, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl");
+    }
+
+    // Track the number of requests processed
+    int request_count = 0;
+    static unsigned long next_request_id = 0;
+
+    // With rate limits, wake up now and then to free the buckets of gone clients
+    int rate_limited = conn_limit_host != NULL || req_limit_host != NULL;
+    time_t last_aged = time(NULL);
+
+    // A reload in progress: the channel to the new instance, its pid and its deadline
+    int handoff_chan = -1;
+    pid_t handoff_pid = -1;
+    time_t handoff_deadline = 0;
+
+    // Main server loop
+    while (request_count < max_requests) {
+        if (dump_requested) {
+            dump_requested = 0;
+            write_trace();
+        }
+        if (reload_requested && handoff_chan < 0) {
+            reload_requested = 0;
+            handoff_chan = handoff_listen_socket(server_socket, argv, &handoff_pid);
+            handoff_deadline = time(NULL) + HANDOFF_TIMEOUT_MS / 1000;
+        }
+
+        // Sleep until the backlog has connections or the new instance answers, signals interrupt the wait
+        struct pollfd pfds[2] = {
+            { .fd = server_socket, .events = POLLIN },
+            { .fd = handoff_chan, .events = POLLIN },   //ignored when -1
+        };
+        int timeout = rate_limited ? RATE_AGE_MS : -1;
+        if (handoff_chan >= 0) {
+            time_t left = handoff_deadline - time(NULL);
+            int left_ms = left > 0 ? (int)left * 1000 : 0;
+            timeout = timeout < 0 || left_ms < timeout ? left_ms : timeout;
+        }
+        int ready = poll(pfds, 2, timeout);
+        if (rate_limited && time(NULL) - last_aged >= RATE_AGE_MS / 1000) {
+            age_rate_limits();
+            last_aged = time(NULL);
+        }
+        if (handoff_chan >= 0 && (pfds[1].revents != 0 || time(NULL) >= handoff_deadline)) {
+            int took_over = finish_handoff(handoff_chan, handoff_pid, 0) == 0;
+            handoff_chan = -1;
+            if (took_over) {
+                break; // The new instance accepts from here on
+            }
+        }
+        if (ready <= 0 || !(pfds[0].revents & POLLIN)) {
+            if (ready < 0 && errno != EINTR) {
+                perror("poll");
+            }
+            continue;
+        }
+
+        // Drain the backlog, then hand the whole batch to the pool at once.
+        // Refused connections count as attempts too, so a flood from one
+        // client cannot hold back the connections already in the batch
+        void* batch[ACCEPT_BATCH];
+        int accepted = 0;
+        int limit = max_requests - request_count < ACCEPT_BATCH ? max_requests - request_count : ACCEPT_BATCH;
+        for (int attempts = 0; attempts < ACCEPT_BATCH && accepted < limit; attempts++) {
+            struct sockaddr_storage peer;
+            socklen_t peer_len = sizeof(peer);
+            int client_socket = accept4(server_socket, (struct sockaddr*)&peer, &peer_len, SOCK_CLOEXEC);
+            if (client_socket < 0) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                    perror("accept");
+                }
+                break;
+            }
+
+            // Over its connection rate: refuse it here, before it takes a worker or a queue slot
+            if (!allow_client(conn_limit_host, conn_limit_prefix, &peer)) {
+                send(client_socket, too_many_connections, sizeof(too_many_connections) - 1,
+                     MSG_DONTWAIT | MSG_NOSIGNAL);
+                close(client_socket);
+                continue;
+            }
+
+            // The worker frees the connection
+            client_conn* conn = (client_conn*)malloc(sizeof(client_conn));
+            if (conn == NULL) {
+                perror("malloc");
+                close(client_socket);
+                continue;
+            }
+            conn->socket = client_socket;
+            conn->peer = peer;
+            conn->id = ++next_request_id;
+            trace_request(conn->id);
+            TRACE_BEGIN("queue", conn->queued);
+            batch[accepted++] = conn;
+        }
+        if (accepted == 0) {
+            continue;
+        }
+
+        // Dispatch the client requests to the thread pool
+        int queued = dispatch_batch(tp, handle_client, batch, accepted);
+        for (int i = queued; i < accepted; i++) {
+            client_conn* conn = (client_conn*)batch[i];
+            close(conn->socket);
+            free(conn);
+        }
+
+        // Increment the request count
+        request_count += accepted;
+    }
+
+    // Out of requests while reloading: the new instance still needs its answer
+    if (handoff_chan >= 0) {
+        time_t left = handoff_deadline - time(NULL);
+        finish_handoff(handoff_chan, handoff_pid, left > 0 ? (int)left * 1000 : 0);
+    }
+
+    // Shut down the server, destroy_threadpool lets in-flight requests finish
+    printf("Processed %d requests. Shutting down...\n", request_count);
+
+    // Clean up
+    close(server_socket);
+    destroy_threadpool(tp);
+    destroy_timerwheel(timers);
+    write_trace();
+    close_bundle(static_bundle);
+    destroy_ratelimiter(conn_limit_host);
+    destroy_ratelimiter(conn_limit_prefix);
+    destroy_ratelimiter(req_limit_host);
+    destroy_ratelimiter(req_limit_prefix);
     return 0;
 }
 
+// bench.c links this file for its hot-path functions and brings its own main
+#ifndef SERVER_NO_MAIN
 int main(int argc, char* argv[]){
     if(argc != 5){
         printf("Usage: server <port> <pool-size> <max-queue-size> <max-number-of-request>\n" );
@@ -535,13 +1370,92 @@ int main(int argc, char* argv[]){
         exit(1);
     }
 
+    // Resolved now, before anything can change the working directory
+    resolve_executable(argv[0]);
+
+    char* bundle_file = getenv(BUNDLE_ENV);
+    if (bundle_file != NULL) {
+        static_bundle = open_bundle(bundle_file);
+        if (static_bundle == NULL) {
+            exit(1);
+        }
+        printf("Serving %u bundled paths from %s\n", static_bundle->header->count, bundle_file);
+    }
+
+    char* conn_rate = getenv(CONN_RATE_ENV);
+    if (conn_rate != NULL) {
+        if (create_rate_limits(conn_rate, &conn_limit_host, &conn_limit_prefix) < 0) {
+            exit(1);
+        }
+        printf("Limiting connections to %u/s per address (burst %u)\n",
+               conn_limit_host->rate, conn_limit_host->burst);
+    }
+    char* req_rate = getenv(REQ_RATE_ENV);
+    if (req_rate != NULL) {
+        if (create_rate_limits(req_rate, &req_limit_host, &req_limit_prefix) < 0) {
+            exit(1);
+        }
+        printf("Limiting requests to %u/s per address (burst %u)\n",
+               req_limit_host->rate, req_limit_host->burst);
+    }
+
+    trace_file = getenv(TRACE_ENV);
+    if (trace_file != NULL) {
+        trace_init();
+        printf("Tracing requests, send SIGUSR1 to write %s\n", trace_file);
+    }
+
+    // Block the control signals while the threads start so only the main thread handles them
+    sigset_t control_signals;
+    sigemptyset(&control_signals);
+    sigaddset(&control_signals, SIGHUP);
+    sigaddset(&control_signals, SIGUSR2);
+    sigaddset(&control_signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &control_signals, NULL);
+    timers = create_timerwheel();
     threadpool* tp = create_threadpool(pool_size, max_queue_size);
-    if (tp == NULL) {
+    listing_pool = tp;
+    pthread_sigmask(SIG_UNBLOCK, &control_signals, NULL);
+    if (timers == NULL || tp == NULL) {
        // fprintf(stderr, "Failed to create thread pool\n");
+        destroy_timerwheel(timers);
+        destroy_threadpool(tp);
         return 1;
     }
 
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    // The signals interrupt poll() in serve with EINTR (poll is never restarted,
+    // SA_RESTART or not), so the loop acts on them without waiting for a connection
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_control_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGHUP, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+    sigaction(SIGUSR1, &sa, NULL);
+
+    // sendfile has no MSG_NOSIGNAL: a client that goes away mid-file must
+    // only fail its own send with EPIPE, not kill the process
+    struct sigaction ignore;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigemptyset(&ignore.sa_mask);
+    sigaction(SIGPIPE, &ignore, NULL);
+
+    // Take over the listening socket if we were started by a reload
+    char* handoff = getenv(HANDOFF_ENV);
+    if (handoff != NULL) {
+        int chan = atoi(handoff);
+        unsetenv(HANDOFF_ENV);
+        int server_socket = receive_listen_socket(chan);
+        if (server_socket < 0) {
+            destroy_threadpool(tp);
+            return 1;
+        }
+        printf("Server took over the listening socket on port %d...\n", port);
+        return serve(server_socket, tp, max_requests, argv);
+    }
+
+    int server_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (server_socket < 0) {
         perror("socket");
         destroy_threadpool(tp);
@@ -567,30 +1481,6 @@ int main(int argc, char* argv[]){
         exit(1);
     }
     printf("Server is listening on port %d...\n", port);
-    // Track the number of requests processed
-    int request_count = 0;
-
-    // Main server loop
-    while (request_count < max_requests) {
-        // Accept a new client connection
-        int client_socket = accept(server_socket, NULL, NULL);
-        if (client_socket < 0) {
-            perror("accept");
-            continue;
-        }
-
-        // Dispatch the client request to the thread pool
-        dispatch(tp, handle_client, (void*)&client_socket);
-
-        // Increment the request count
-        request_count++;
-    }
-
-    // Shut down the server after processing the maximum number of requests
-    printf("Processed %d requests. Shutting down...\n", max_requests);
-
-    // Clean up
-    close(server_socket);
-    destroy_threadpool(tp);
-    return 0;
-}
\ No newline at end of file
+    return serve(server_socket, tp, max_requests, argv);
+}
+#endif
@@ -30,6 +30,7 @@ threadpool* create_threadpool(int num_threads_in_pool, int max_queue_size){
     pthread_cond_init(&tp->q_not_full,NULL);
     tp->shutdown = 0;
     tp->dont_accept = 0;
+    tp->idle = 0;
 
     tp->threads = (pthread_t*)malloc(num_threads_in_pool * sizeof(pthread_t));
     if (tp->threads == NULL) {
@@ -97,6 +98,171 @@ void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg){
     pthread_mutex_unlock(&from_me->qlock);
 }
 
+// wakes idle threads for "jobs" new jobs, called with qlock held
+static void wake_workers(threadpool* tp, int jobs){
+    int wake = jobs < tp->idle ? jobs : tp->idle;
+    for (int i = 0; i < wake; i++) {
+        pthread_cond_signal(&tp->q_not_empty);
+    }
+}
+
+int dispatch_batch(threadpool* from_me, dispatch_fn dispatch_to_here, void** args, int n){
+    // Allocate outside the lock, the acceptor should hold it as briefly as possible
+    work_t** works = (work_t**)malloc(n * sizeof(work_t*));
+    if (works == NULL) {
+        perror("malloc for work_t batch");
+        return 0;
+    }
+    int allocated = 0;
+    while (allocated < n) {
+        work_t *work = (work_t*)malloc(sizeof(work_t));
+        if (work == NULL) {
+            perror("malloc for work_t");
+            break;
+        }
+        work->routine = dispatch_to_here;
+        work->arg = args[allocated];
+        work->next = NULL;
+        works[allocated++] = work;
+    }
+
+    pthread_mutex_lock(&from_me->qlock);
+    int queued = 0;
+    int unwoken = 0;    //jobs queued since the last wake_workers
+    while (queued < allocated && !from_me->dont_accept) {
+        // Wait if the queue is full, after waking threads for what is already queued
+        if (from_me->qsize == from_me->max_qsize) {
+            wake_workers(from_me, unwoken);
+            unwoken = 0;
+            pthread_cond_wait(&from_me->q_not_full, &from_me->qlock);
+            continue;
+        }
+
+        work_t *work = works[queued++];
+        if (from_me->qtail == NULL) { //queue is empty
+            from_me->qhead = from_me->qtail = work;
+        } else {
+            from_me->qtail->next = work;
+            from_me->qtail = work;
+        }
+        from_me->qsize++;
+        unwoken++;
+    }
+    wake_workers(from_me, unwoken);
+    pthread_mutex_unlock(&from_me->qlock);
+
+    for (int i = queued; i < allocated; i++) {
+        free(works[i]);
+    }
+    free(works);
+    return queued;
+}
+
+// Drops one reference to "f", the last one frees it
+static void release_future(future_t* f){
+    if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_destroy(&f->lock);
+        pthread_cond_destroy(&f->done);
+        free(f);
+    }
+}
+
+// Runs the job of "f" if no other thread has claimed it, returns 1 if it did
+static int claim_and_run(future_t* f){
+    int expected = FUTURE_PENDING;
+    if (!__atomic_compare_exchange_n(&f->state, &expected, FUTURE_RUNNING, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    int result = f->routine(f->arg);
+    pthread_mutex_lock(&f->lock);
+    f->result = result;
+    __atomic_store_n(&f->state, FUTURE_DONE, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&f->done);
+    pthread_mutex_unlock(&f->lock);
+    return 1;
+}
+
+// The queued job of a future, the waiter may have run it already
+static int run_future(void* arg){
+    future_t* f = (future_t*)arg;
+    claim_and_run(f);
+    release_future(f);
+    return 0;
+}
+
+future_t* submit(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg){
+    future_t* f = (future_t*)malloc(sizeof(future_t));
+    if (f == NULL) {
+        perror("malloc for future_t");
+        return NULL;
+    }
+    f->routine = dispatch_to_here;
+    f->arg = arg;
+    f->state = FUTURE_PENDING;
+    f->result = 0;
+    f->refs = 1;
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->done, NULL);
+
+    // Without a work_t the future just stays pending, the waiter runs it
+    work_t *work = (work_t*)malloc(sizeof(work_t));
+    if (work == NULL) {
+        return f;
+    }
+    work->routine = run_future;
+    work->arg = f;
+    work->next = NULL;
+
+    pthread_mutex_lock(&from_me->qlock);
+    if (from_me->dont_accept || from_me->qsize == from_me->max_qsize) {
+        pthread_mutex_unlock(&from_me->qlock);
+        free(work);
+        return f;
+    }
+    f->refs = 2;
+    if (from_me->qtail == NULL) { //queue is empty
+        from_me->qhead = from_me->qtail = work;
+    } else {
+        from_me->qtail->next = work;
+        from_me->qtail = work;
+    }
+    from_me->qsize++;
+    wake_workers(from_me, 1);
+    pthread_mutex_unlock(&from_me->qlock);
+    return f;
+}
+
+int future_wait(future_t* f){
+    if (!claim_and_run(f)) {
+        pthread_mutex_lock(&f->lock);
+        while (__atomic_load_n(&f->state, __ATOMIC_ACQUIRE) != FUTURE_DONE) {
+            pthread_cond_wait(&f->done, &f->lock);
+        }
+        pthread_mutex_unlock(&f->lock);
+    }
+    return f->result;
+}
+
+int future_wait_all(future_t** fs, int n){
+    // Work through what the pool has not started before sleeping on the rest
+    for (int i = 0; i < n; i++) {
+        claim_and_run(fs[i]);
+    }
+    int failed = 0;
+    for (int i = 0; i < n; i++) {
+        if (future_wait(fs[i]) != 0) {
+            failed++;
+        }
+    }
+    return failed;
+}
+
+void destroy_future(future_t* f){
+    if (f == NULL) return;
+    release_future(f);
+}
+
 void* do_work(void* p){
     threadpool* tp = (threadpool*)p;
     while(1){
@@ -106,8 +272,11 @@ void* do_work(void* p){
             pthread_exit(NULL);
         }
 
-        if(tp->qsize == 0){
+        // Another worker may take the job before this one wakes up, check again
+        while(tp->qsize == 0 && !tp->shutdown){
+            tp->idle++;
             pthread_cond_wait(&tp->q_not_empty,&tp->qlock);
+            tp->idle--;
         }
 
         if(tp->shutdown){
@@ -123,9 +292,9 @@ void* do_work(void* p){
             tp->qtail = NULL;
         }
 
-        if (tp->qsize == tp->max_qsize - 1){
-            pthread_cond_signal(&tp->q_not_full);
-        }
+        // Every freed slot can let a waiting producer in, with several producers
+        // signalling only on the full -> not full edge loses wakeups
+        pthread_cond_signal(&tp->q_not_full);
 
         if(tp->qsize == 0 && tp->dont_accept){
             pthread_cond_signal(&tp->q_empty);
@@ -35,6 +35,7 @@ typedef struct _threadpool_st {
 	pthread_cond_t q_not_empty;	//non empty and empty condidtion vairiables
 	pthread_cond_t q_empty;
 	pthread_cond_t q_not_full;      //full conditional variable
+	int idle;               //number of threads waiting on q_not_empty
     int shutdown;            //1 if the pool is in distruction process     
     int dont_accept;       //1 if destroy function has begun
 } threadpool;
@@ -48,6 +49,24 @@ typedef struct _threadpool_st {
 
 typedef int (*dispatch_fn)(void *);
 
+// states of a future
+#define FUTURE_PENDING 0    //not started, whoever claims it first runs it
+#define FUTURE_RUNNING 1
+#define FUTURE_DONE 2
+
+/**
+ * A job whose result can be waited for, returned by submit
+ */
+typedef struct future_st {
+      dispatch_fn routine;  //the job
+      void * arg;  //argument to the job
+      int state;   //FUTURE_PENDING, FUTURE_RUNNING or FUTURE_DONE
+      int result;  //what routine returned, once done
+      int refs;    //the submitter, plus the queue while the job is queued
+      pthread_mutex_t lock;
+      pthread_cond_t done;
+} future_t;
+
 /**
  * create_threadpool creates a fixed-sized thread
  * pool.  If the function succeeds, it returns a (non-NULL)
@@ -75,6 +94,46 @@ threadpool* create_threadpool(int num_threads_in_pool, int max_queue_size);
  */
 void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
 
+/**
+ * dispatch_batch enters "n" jobs, one for each of "args", under a single
+ * acquisition of the queue lock, and wakes at most as many idle threads
+ * as there are new jobs. If the queue fills up it waits like dispatch.
+ * Returns the number of jobs queued, the first ones of "args". It is
+ * less than "n" if the pool is being destroyed or if allocating the
+ * work_t elements failed (then it may be 0); the caller still owns the
+ * args that were not queued and has to release them.
+ */
+int dispatch_batch(threadpool* from_me, dispatch_fn dispatch_to_here, void** args, int n);
+
+/**
+ * submit enters a job like dispatch and returns a future to wait for it.
+ * It never waits for room: if the queue is full (or the pool is being
+ * destroyed) the job stays pending and future_wait runs it on the
+ * waiting thread, so a worker can submit and wait without deadlocking
+ * the pool. Returns NULL if the future cannot be allocated.
+ */
+future_t* submit(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * future_wait waits for the job to finish and returns its result.
+ * A job no thread has started yet is run by the caller.
+ */
+int future_wait(future_t* f);
+
+/**
+ * future_wait_all waits for "n" jobs. The caller first runs every job
+ * still pending, then waits for the ones other threads are running.
+ * Returns the number of jobs whose result is not 0.
+ */
+int future_wait_all(future_t** fs, int n);
+
+/**
+ * destroy_future releases the submitter's hold on the future, which is
+ * freed once the pool is done with it too. Call it after waiting:
+ * a job that was never waited for may never run.
+ */
+void destroy_future(future_t* f);
+
 /**
  * The work function of the thread
  * this function should:
@@ -0,0 +1,163 @@
+#include "timerwheel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+#define TW_MASK (TW_SLOTS - 1)
+
+// Links "timer" into the slot its deadline falls in, relative to tw->now
+static void place_timer(timerwheel* tw, tw_timer* timer) {
+    unsigned long long delta = timer->deadline - tw->now;
+    int level = 0;
+    while (level < TW_LEVELS - 1 && delta >= (1ULL << (TW_SLOT_BITS * (level + 1)))) {
+        level++;
+    }
+
+    // Past the top level, park it in the farthest slot and let cascading bring it back
+    unsigned long long at = timer->deadline;
+    if (delta >= (1ULL << (TW_SLOT_BITS * TW_LEVELS))) {
+        at = tw->now + (1ULL << (TW_SLOT_BITS * TW_LEVELS)) - 1;
+    }
+    tw_timer** slot = &tw->slots[level][(at >> (TW_SLOT_BITS * level)) & TW_MASK];
+
+    timer->next = *slot;
+    if (*slot != NULL) {
+        (*slot)->pprev = &timer->next;
+    }
+    timer->pprev = slot;
+    *slot = timer;
+}
+
+static void unlink_timer(tw_timer* timer) {
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+// Moves the timers of one slot of "level" down to the levels below
+static void cascade(timerwheel* tw, int level) {
+    tw_timer** slot = &tw->slots[level][(tw->now >> (TW_SLOT_BITS * level)) & TW_MASK];
+    tw_timer* timer = *slot;
+    *slot = NULL;
+    while (timer != NULL) {
+        tw_timer* next = timer->next;
+        place_timer(tw, timer);
+        timer = next;
+    }
+}
+
+// Advances the wheel by one tick and expires the timers that are due
+static void tick(timerwheel* tw) {
+    tw->now++;
+
+    // Every time a level wraps, the next slot of the level above is due for cascading
+    for (int level = 1; level < TW_LEVELS; level++) {
+        if (((tw->now >> (TW_SLOT_BITS * (level - 1))) & TW_MASK) != 0) {
+            break;
+        }
+        cascade(tw, level);
+    }
+
+    tw_timer** slot = &tw->slots[0][tw->now & TW_MASK];
+    while (*slot != NULL) {
+        tw_timer* timer = *slot;
+        unlink_timer(timer);
+        tw->pending--;
+        timer->expire(timer->arg);
+    }
+}
+
+static unsigned long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void* run_wheel(void* p) {
+    timerwheel* tw = (timerwheel*)p;
+    unsigned long long start = now_ms();
+    struct timespec nap = { .tv_sec = 0, .tv_nsec = TW_TICK_MS * 1000000L };
+
+    while (1) {
+        nanosleep(&nap, NULL);
+
+        // Catch up on every tick that passed, a late wakeup must not stretch timeouts
+        unsigned long long target = (now_ms() - start) / TW_TICK_MS;
+        pthread_mutex_lock(&tw->lock);
+        if (tw->shutdown) {
+            pthread_mutex_unlock(&tw->lock);
+            return NULL;
+        }
+        while (tw->now < target) {
+            tick(tw);
+        }
+        pthread_mutex_unlock(&tw->lock);
+    }
+}
+
+timerwheel* create_timerwheel(void) {
+    timerwheel* tw = (timerwheel*)malloc(sizeof(timerwheel));
+    if (tw == NULL) {
+        perror("timerwheel malloc");
+        return NULL;
+    }
+    memset(tw->slots, 0, sizeof(tw->slots));
+    tw->now = 0;
+    tw->pending = 0;
+    tw->shutdown = 0;
+    pthread_mutex_init(&tw->lock, NULL);
+
+    int rc = pthread_create(&tw->thread, NULL, run_wheel, tw);
+    if (rc) {
+        errno = rc;
+        perror("timer thread create");
+        pthread_mutex_destroy(&tw->lock);
+        free(tw);
+        return NULL;
+    }
+    return tw;
+}
+
+void add_timer(timerwheel* tw, tw_timer* timer, unsigned long timeout_ms, timer_fn expire, void* arg) {
+    // At least one tick, the current slot has already been processed
+    unsigned long long ticks = (timeout_ms + TW_TICK_MS - 1) / TW_TICK_MS;
+    if (ticks == 0) {
+        ticks = 1;
+    }
+
+    timer->expire = expire;
+    timer->arg = arg;
+    pthread_mutex_lock(&tw->lock);
+    timer->deadline = tw->now + ticks;
+    place_timer(tw, timer);
+    tw->pending++;
+    pthread_mutex_unlock(&tw->lock);
+}
+
+int cancel_timer(timerwheel* tw, tw_timer* timer) {
+    int was_pending = 0;
+    pthread_mutex_lock(&tw->lock);
+    if (timer->pprev != NULL) {
+        unlink_timer(timer);
+        tw->pending--;
+        was_pending = 1;
+    }
+    pthread_mutex_unlock(&tw->lock);
+    return was_pending;
+}
+
+void destroy_timerwheel(timerwheel* tw) {
+    if (tw == NULL) return;
+    pthread_mutex_lock(&tw->lock);
+    tw->shutdown = 1;
+    pthread_mutex_unlock(&tw->lock);
+    pthread_join(tw->thread, NULL);
+
+    pthread_mutex_destroy(&tw->lock);
+    free(tw);
+}
@@ -0,0 +1,69 @@
+#include <pthread.h>
+
+/**
+ * timerwheel.h
+ *
+ * This file declares a hierarchical timing wheel: TW_LEVELS wheels of
+ * TW_SLOTS slots, each level TW_SLOTS times coarser than the one below.
+ * Adding and cancelling a timer is O(1), and one thread advances the
+ * wheel once per tick no matter how many timers are pending.
+ */
+
+#define TW_LEVELS 4
+#define TW_SLOT_BITS 6
+#define TW_SLOTS (1 << TW_SLOT_BITS)
+#define TW_TICK_MS 100
+
+// "timer_fn" is called by the wheel thread when a timer expires.
+// It runs with the wheel lock held, so it must be short and must
+// not add or cancel timers.
+typedef void (*timer_fn)(void *);
+
+/**
+ * A timer lives inside the object it times out, the wheel never allocates.
+ */
+typedef struct tw_timer_st {
+    timer_fn expire;            //called on expiry
+    void* arg;                  //argument to expire
+    unsigned long long deadline;    //tick on which the timer expires
+    struct tw_timer_st* next;
+    struct tw_timer_st** pprev;     //the pointer that points to this timer, NULL when not pending
+} tw_timer;
+
+/**
+ * The wheel
+ */
+typedef struct timerwheel_st {
+    tw_timer* slots[TW_LEVELS][TW_SLOTS];
+    unsigned long long now;     //current tick
+    int pending;                //number of timers in the wheel
+    pthread_mutex_t lock;       //lock on the slots
+    pthread_t thread;           //thread that advances the wheel
+    int shutdown;               //1 if the wheel is being destroyed
+} timerwheel;
+
+/**
+ * create_timerwheel creates the wheel and starts its thread.
+ * If the function succeeds, it returns a (non-NULL) "timerwheel", else it returns NULL.
+ */
+timerwheel* create_timerwheel(void);
+
+/**
+ * add_timer arms "timer" to call "expire" with "arg" after about
+ * "timeout_ms" milliseconds (rounded up to whole ticks).
+ * The timer must not be pending.
+ */
+void add_timer(timerwheel* tw, tw_timer* timer, unsigned long timeout_ms, timer_fn expire, void* arg);
+
+/**
+ * cancel_timer disarms "timer". Returns 1 if it was still pending,
+ * 0 if it already expired. Either way, once it returns the expire
+ * function is not running and will not run.
+ */
+int cancel_timer(timerwheel* tw, tw_timer* timer);
+
+/**
+ * destroy_timerwheel stops the wheel thread and frees the wheel.
+ * Pending timers are dropped without being called.
+ */
+void destroy_timerwheel(timerwheel* tw);
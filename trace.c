@@ -0,0 +1,126 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+typedef struct trace_event_st {
+    const char* stage;      //string literal, never freed
+    unsigned long request;
+    unsigned long long start;
+    unsigned long long end;
+    int async;
+} trace_event;
+
+// One per thread, written only by its thread
+typedef struct trace_buffer_st {
+    trace_event events[TRACE_EVENTS];
+    unsigned long count;    //spans ever recorded, published with release
+    int tid;
+    struct trace_buffer_st* next;
+} trace_buffer;
+
+int trace_enabled = 0;
+__thread unsigned long trace_request_id = 0;
+
+static __thread trace_buffer* my_buffer = NULL;
+static trace_buffer* buffers = NULL;
+static int next_tid = 1;
+static pthread_mutex_t buffers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void trace_init(void) {
+    trace_enabled = 1;
+}
+
+void trace_request(unsigned long id) {
+    trace_request_id = id;
+}
+
+unsigned long long trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// The first span of a thread registers its buffer, the only time the lock is taken
+static trace_buffer* register_buffer(void) {
+    trace_buffer* b = (trace_buffer*)calloc(1, sizeof(trace_buffer));
+    if (b == NULL) {
+        perror("trace buffer calloc");
+        return NULL;
+    }
+    pthread_mutex_lock(&buffers_lock);
+    b->tid = next_tid++;
+    b->next = buffers;
+    buffers = b;
+    pthread_mutex_unlock(&buffers_lock);
+    return b;
+}
+
+void trace_span(const char* stage, unsigned long long start, unsigned long long end, int async) {
+    if (my_buffer == NULL) {
+        my_buffer = register_buffer();
+        if (my_buffer == NULL) return;
+    }
+
+    unsigned long n = my_buffer->count;
+    trace_event* e = &my_buffer->events[n % TRACE_EVENTS];
+    e->stage = stage;
+    e->request = trace_request_id;
+    e->start = start;
+    e->end = end;
+    e->async = async;
+    __atomic_store_n(&my_buffer->count, n + 1, __ATOMIC_RELEASE);
+}
+
+int dump_trace(const char* file) {
+    FILE* out = fopen(file, "w");
+    if (out == NULL) {
+        perror(file);
+        return -1;
+    }
+
+    int pid = getpid();
+    int written = 0;
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+
+    pthread_mutex_lock(&buffers_lock);
+    for (trace_buffer* b = buffers; b != NULL; b = b->next) {
+        fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+                     "\"args\":{\"name\":\"thread %d\"}}",
+                b != buffers ? ",\n" : "", pid, b->tid, b->tid);
+
+        unsigned long count = __atomic_load_n(&b->count, __ATOMIC_ACQUIRE);
+        unsigned long first = count > TRACE_EVENTS ? count - TRACE_EVENTS : 0;
+        for (unsigned long i = first; i < count; i++) {
+            trace_event e = b->events[i % TRACE_EVENTS];
+            double ts = e.start / 1000.0;
+            double dur = (e.end - e.start) / 1000.0;
+            if (e.async) {
+                // Waits overlap each other, async spans get their own rows
+                fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"wait\",\"ph\":\"b\",\"id\":%lu,"
+                             "\"pid\":%d,\"tid\":%d,\"ts\":%.3f}"
+                             ",\n{\"name\":\"%s\",\"cat\":\"wait\",\"ph\":\"e\",\"id\":%lu,"
+                             "\"pid\":%d,\"tid\":%d,\"ts\":%.3f}",
+                        e.stage, e.request, pid, b->tid, ts,
+                        e.stage, e.request, pid, b->tid, ts + dur);
+            } else {
+                fprintf(out, ",\n{\"name\":\"%s\",\"cat\":\"request\",\"ph\":\"X\","
+                             "\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+                             "\"args\":{\"request\":%lu}}",
+                        e.stage, pid, b->tid, ts, dur, e.request);
+            }
+            written++;
+        }
+    }
+    pthread_mutex_unlock(&buffers_lock);
+
+    fprintf(out, "\n]}\n");
+    if (fclose(out) != 0) {
+        perror("fclose");
+        return -1;
+    }
+    return written;
+}
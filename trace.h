@@ -0,0 +1,77 @@
+/**
+ * trace.h
+ *
+ * This file declares the request stage tracer. Each thread records
+ * timestamped spans into its own ring buffer, without locks, and
+ * dump_trace writes them as Chrome trace JSON (chrome://tracing,
+ * ui.perfetto.dev). Tracing is off until trace_init is called.
+ *
+ * Every stage is also a pair of USDT probes, webserver:stage_begin
+ * and webserver:stage_end (stage name, request id), when the build
+ * has <sys/sdt.h>. They cost a nop when nothing is attached.
+ */
+
+// number of spans kept per thread, older ones are overwritten
+#define TRACE_EVENTS 8192
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define TRACE_PROBE(probe, stage) DTRACE_PROBE2(webserver, probe, stage, trace_request_id)
+#endif
+#endif
+#ifndef TRACE_PROBE
+#define TRACE_PROBE(probe, stage) do { } while (0)
+#endif
+
+// Marks the start of "stage", "start" receives its timestamp
+#define TRACE_BEGIN(stage, start) do { \
+        TRACE_PROBE(stage_begin, stage); \
+        (start) = trace_enabled ? trace_now() : 0; \
+    } while (0)
+
+// Records "stage" on this thread from "start" until now
+#define TRACE_END(stage, start) do { \
+        TRACE_PROBE(stage_end, stage); \
+        if (trace_enabled) trace_span(stage, start, trace_now(), 0); \
+    } while (0)
+
+// Same, for a wait that started on another thread (shown as an async span)
+#define TRACE_WAIT_END(stage, start) do { \
+        TRACE_PROBE(stage_end, stage); \
+        if (trace_enabled) trace_span(stage, start, trace_now(), 1); \
+    } while (0)
+
+// 1 once trace_init has been called
+extern int trace_enabled;
+
+// request the calling thread is working on, set with trace_request
+extern __thread unsigned long trace_request_id;
+
+/**
+ * trace_init turns tracing on.
+ */
+void trace_init(void);
+
+/**
+ * trace_request sets the request id the calling thread's spans belong to.
+ */
+void trace_request(unsigned long id);
+
+/**
+ * trace_now returns a monotonic timestamp in nanoseconds.
+ */
+unsigned long long trace_now(void);
+
+/**
+ * trace_span records a span of the current request on the calling thread.
+ */
+void trace_span(const char* stage, unsigned long long start, unsigned long long end, int async);
+
+/**
+ * dump_trace writes every thread's recorded spans to "file" as Chrome
+ * trace JSON. Threads keep recording meanwhile, so a span overwritten
+ * during the dump may come out torn; that is fine for a profile.
+ * Returns the number of spans written, or -1 on error.
+ */
+int dump_trace(const char* file);